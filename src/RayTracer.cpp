@@ -11,6 +11,7 @@
 #include "scene/Ray.h"
 #include "fileio/read.h"
 #include "fileio/parse.h"
+#include "scene/bvhcache.h"
 #include "SceneObjects/Box.h"
 
 // Trace a top-level ray through normalized window coordinates (x,y)
@@ -45,81 +46,90 @@ vec3f RayTracer::traceRay( Scene *scene, const Ray& r,
 		return vec3f();
 	
 	Isect i;
+	if( scene->bvhIntersect( r, i ) )
+		return shadeHit( scene, r, i, thresh, depth, curFactor );
+	return shadeMiss( scene, r );
+}
 
-	if( scene->bvhIntersect( r, i ) ) {
-		// YOUR CODE HERE
+// Color of the ray r that hit at i, traced depth bounces from the camera
+vec3f RayTracer::shadeHit( Scene *scene, const Ray& r, const Isect& i,
+	const vec3f& thresh, int depth, const vec3f& curFactor )
+{
+	// YOUR CODE HERE
 
-		// An intersection occured!  We've got work to do.  For now,
-		// this code gets the material for the surface that was intersected,
-		// and asks that material to provide a color for the ray.  
+	// An intersection occured!  We've got work to do.  For now,
+	// this code gets the material for the surface that was intersected,
+	// and asks that material to provide a color for the ray.  
 
-		// This is a great place to insert code for recursive ray tracing.
-		// Instead of just returning the result of shade(), add some
-		// more steps: add in the contributions from reflected and refracted
-		// rays.
+	// This is a great place to insert code for recursive ray tracing.
+	// Instead of just returning the result of shade(), add some
+	// more steps: add in the contributions from reflected and refracted
+	// rays.
 
-		const Material& m = i.getMaterial();
+	const Material& m = i.getMaterial();
 
-		vec3f reflective = m.fresnelReflective(-r.getDirection(), i.N);
-		vec3f directIllumination = m.shade(scene, r, i);
-		vec3f indirectIllumination, factor(1.0);
+	vec3f reflective = m.fresnelReflective(-r.getDirection(), i.N);
+	vec3f directIllumination = m.shade(scene, r, i);
+	vec3f indirectIllumination, factor(1.0);
 
-		if (!reflective.iszero())
+	if (!reflective.iszero())
+	{
+		Ray reflection = r.reflect(i);
+		if (enableDistributed)
 		{
-			Ray reflection = r.reflect(i);
-			if (enableDistributed)
+			vec3f normal = i.N.dot(r.getDirection()) < 0.0 ? i.N : -i.N;
+			vec3f tmp, position = r.at(i.t) + normal * DISPLACEMENT_EPSILON;
+			for (int j = 0; j < numChildRay; ++j)
 			{
-				vec3f normal = i.N.dot(r.getDirection()) < 0.0 ? i.N : -i.N;
-				vec3f tmp, position = r.at(i.t) + normal * DISPLACEMENT_EPSILON;
-				for (int j = 0; j < numChildRay; ++j)
-				{
-					reflection = Ray(position, m.randomReflect(r.getDirection(), i.N));
-					tmp += prod(traceRay(scene, reflection, thresh, depth + 1, prod(curFactor, m.kr)), reflective);
-				}
-				tmp /= numChildRay;
-				indirectIllumination += tmp;
-			}
-			else
-			{
-				indirectIllumination += prod(traceRay(scene, reflection, thresh, depth + 1,
-					prod(curFactor, m.kr)), reflective);
+				reflection = Ray(position, m.randomReflect(r.getDirection(), i.N));
+				tmp += prod(traceRay(scene, reflection, thresh, depth + 1, prod(curFactor, m.kr)), reflective);
 			}
+			tmp /= numChildRay;
+			indirectIllumination += tmp;
 		}
-
-		Ray refraction{vec3f(), vec3f()};
-		if (!m.kt.iszero() && r.refract(i, refraction))
+		else
 		{
-			indirectIllumination += prod(traceRay(scene, refraction, thresh, depth + 1, prod(curFactor, m.kt)), m.kt);
+			indirectIllumination += prod(traceRay(scene, reflection, thresh, depth + 1,
+				prod(curFactor, m.kr)), reflective);
 		}
+	}
 
-		// Travel inside a transparent object, apply Beer's law
-		if (i.N.dot(r.getDirection()) > 0.0 && !m.absorb.iszero())
-		{
-			double distTraveled = i.t;
-			factor = -m.absorb * distTraveled;
-			factor[0] = exp(factor[0]);
-			factor[1] = exp(factor[1]);
-			factor[2] = exp(factor[2]);
-		}
+	Ray refraction{vec3f(), vec3f()};
+	if (!m.kt.iszero() && r.refract(i, refraction))
+	{
+		indirectIllumination += prod(traceRay(scene, refraction, thresh, depth + 1, prod(curFactor, m.kt)), m.kt);
+	}
+
+	// Travel inside a transparent object, apply Beer's law
+	if (i.N.dot(r.getDirection()) > 0.0 && !m.absorb.iszero())
+	{
+		double distTraveled = i.t;
+		factor = -m.absorb * distTraveled;
+		factor[0] = exp(factor[0]);
+		factor[1] = exp(factor[1]);
+		factor[2] = exp(factor[2]);
+	}
+
+	// So far we don't have a uniform model in Whitted ray tracing to
+	// distinguish diffuse and specular surfaces
+	if (enablePM && m.kr.iszero() && m.kt.iszero())
+		indirectIllumination += prod(gatherPhoton(r.at(i.t)), m.kd);
 
-		// So far we don't have a uniform model in Whitted ray tracing to
-		// distinguish diffuse and specular surfaces
-		if (enablePM && m.kr.iszero() && m.kt.iszero())
-			indirectIllumination += prod(gatherPhoton(r.at(i.t)), m.kd);
+	return prod(directIllumination + indirectIllumination, factor);
+}
 
-		return prod(directIllumination + indirectIllumination, factor);
+vec3f RayTracer::shadeMiss( Scene *scene, const Ray& r )
+{
+	// No intersection.  This ray travels to infinity, so we color
+	// it according to the background color, which in this (simple) case
+	// is just black.
 	
-	} else {
-		// No intersection.  This ray travels to infinity, so we color
-		// it according to the background color, which in this (simple) case
-		// is just black.
-		
-		if (!scene->useSkybox)
-			return vec3f( 0.0, 0.0, 0.0 );
-		
-		scene->skybox->intersect(r, i);
-		return scene->skybox->getColor(r, i) / 255.0;
-	}
+	if (!scene->useSkybox)
+		return vec3f( 0.0, 0.0, 0.0 );
+	
+	Isect i;
+	scene->skybox->intersect(r, i);
+	return scene->skybox->getColor(r, i) / 255.0;
 }
 
 vec3f RayTracer::tracePath(Scene* scene, const Ray& ray, int depth)
@@ -160,10 +170,8 @@ vec3f RayTracer::tracePath(Scene* scene, const Ray& ray, int depth)
 			Ray lightRay(pos, lightDir);
 			double distance = (directLight.getPosition() - pos).length();
 
-			Isect shadowRay;
-
 			// Direct illumination part
-			if (!scene->bvhIntersect(lightRay, shadowRay) || shadowRay.t > distance - RAY_EPSILON)
+			if (!scene->occluded(lightRay, distance - RAY_EPSILON))
 			{
 				vec3f bxdf = material.bxdf(lightDir, -curRay.getDirection(), isect.N);
 				// From sampling solid angle to sampling light area
@@ -203,8 +211,8 @@ void RayTracer::buildPhotonMap()
 {
 	if (!m_bSceneLoaded)
 		return;
-	photonMap.clear();
 	delete kdTree;
+	kdTree = nullptr;
 	
 	vector<Light*> lights;
 	for (auto* light : scene->lights)
@@ -213,22 +221,65 @@ void RayTracer::buildPhotonMap()
 			lights.push_back(light);
 		light->buildProjectionMap();
 	}
+	if (lights.empty())
+		return;
 
+	// Photons are emitted in batches of batchSize rounds over the lights.  The
+	// batches of a pass run on the render threads, each with its own random
+	// sequence and buffer, and their photons are added in order after the pass.
+	// The first pass guesses every photon is stored, the later ones go by the
+	// share stored so far.
 	// TODO: emit photons according to the importance of each light
-	while (photonMap.size() < numPhotons)
+	const int batchSize = 1024;
+	int batches = 0;		// emitted so far
+	vector<Photon> photonMap;
+	while (int(photonMap.size()) < numPhotons)
 	{
-		for (auto* light : lights)
-			tracePhoton(light->emitPhoton());
+		int passBatches;
+		if (photonMap.empty())
+			passBatches = numPhotons / (batchSize * int(lights.size())) + 1;
+		else
+			passBatches = int((numPhotons - photonMap.size()) * double(batches) / photonMap.size()) + 1;
+		passBatches = min(passBatches, 1 << 16);
+
+		vector<vector<Photon>> stored(passBatches);
+		getScheduler().parallelFor(passBatches, 1, [&](int begin, int end)
+		{
+			for (int b = begin; b < end; ++b)
+			{
+				Random rng(batches + b);
+				RandomScope scope(rng);
+				for (int n = 0; n < batchSize; ++n)
+				{
+					for (auto* light : lights)
+					{
+						vec3f power;
+						Ray ray = light->emitPhoton(power);
+						tracePhoton(ray, power, stored[b]);
+					}
+				}
+			}
+		});
+		batches += passBatches;
+
+		size_t count = photonMap.size();
+		for (const auto& batch : stored)
+			photonMap.insert(photonMap.end(), batch.begin(), batch.end());
+		if (photonMap.size() == count)		// nothing in the scene stores photons
+			break;
 	}
+	if (int(photonMap.size()) > numPhotons)
+		photonMap.resize(numPhotons);
 
-	kdTree = new KdTree(photonMap, 3);
+	kdTree = new KdTree(std::move(photonMap), 3, &getScheduler());
 }
 
-void RayTracer::tracePhoton(Photon* cur)
+// Follows a photon of power along ray through specular bounces, adds it to
+// stored where it lands on a diffuse surface after at least one
+void RayTracer::tracePhoton(Ray ray, vec3f power, vector<Photon>& stored) const
 {
 	int bounce = 0;
 	bool hitSpecular = false;
-	Ray ray(cur->position, cur->direction);
 	while (bounce < maxBounce)
 	{
 		Isect isect;
@@ -250,7 +301,7 @@ void RayTracer::tracePhoton(Photon* cur)
 			if (!ray.refract(isect, tmp))
 				break;
 			hitSpecular = true;
-			cur->power = prod(cur->power, material.kt);
+			power = prod(power, material.kt);
 			ray = tmp;
 			++bounce;
 			continue;
@@ -260,36 +311,33 @@ void RayTracer::tracePhoton(Photon* cur)
 		{
 			ray = ray.reflect(isect);
 			hitSpecular = true;
-			cur->power[0] *= material.kr[0];
-			cur->power[1] *= material.kr[1];
-			cur->power[2] *= material.kr[2];
+			power[0] *= material.kr[0];
+			power[1] *= material.kr[1];
+			power[2] *= material.kr[2];
 			++bounce;
 			continue;
 		}
 
 		if (hitSpecular)
-		{
-			auto* photon = new Photon{ray.at(isect.t), ray.getDirection(), cur->power};
-			photonMap.push_back(photon);
-		}
+			stored.push_back(Photon(ray.at(isect.t), ray.getDirection(), power));
 		break;
 	}
-	delete cur;
 }
 
 vec3f RayTracer::gatherPhoton(const vec3f& pos)
 {
+	if (kdTree == nullptr)
+		return vec3f();
 	vec3f flux;
 	double maxDist2 = 0.0;
-	auto nearestPhotons = kdTree->getKnn(pos, numNeighbours, maxDist);
-	if (nearestPhotons.empty())
+	KdTree::Neighbour nearest[KdTree::maxNeighbours];
+	int count = kdTree->getKnn(pos, min(numNeighbours, KdTree::maxNeighbours), maxDist, nearest);
+	if (count == 0)
 		return vec3f();
-	for (auto* photon : nearestPhotons)
+	for (int k = 0; k < count; ++k)
 	{
-		double curDist2 = (photon->position - pos).length_squared();
-		if (curDist2 > maxDist2)
-			maxDist2 = curDist2;
-		flux += photon->power;
+		maxDist2 = _max(maxDist2, nearest[k].distance2);
+		flux += nearest[k].photon->getPower();
 	}
 	return prod(flux, totalFlux) / (numPhotons * PI * maxDist2 + RAY_EPSILON);
 }
@@ -307,6 +355,8 @@ RayTracer::RayTracer()
 
 RayTracer::~RayTracer()
 {
+	delete scheduler;
+	delete kdTree;
 	delete [] buffer;
 	delete scene;
 }
@@ -359,7 +409,16 @@ bool RayTracer::loadScene( char* fn )
 	buffer = new unsigned char[ bufferSize ];
 	
 	// separate objects into bounded and unbounded and calculate BVH
-	scene->initScene();
+	scene->setBVHSplitMethod(bvhSplitMethod);
+	scene->setBVHThreads(numThreads);
+	if (bvhCacheDir.empty())
+		scene->initScene();
+	else
+	{
+		BVHCache cache(BVHCache::pathFor(bvhCacheDir, fn));
+		scene->initScene(&cache);
+		cache.save();
+	}
 	
 	// Add any specialized scene loading code here
 	
@@ -422,20 +481,131 @@ void RayTracer::traceSetup( int w, int h, int maxDepth, const vec3f& threshold )
 	this->threshold = threshold;
 }
 
+void RayTracer::setNumThreads(int value)
+{
+	numThreads = value;
+	delete scheduler;
+	scheduler = nullptr;
+	if (m_bSceneLoaded)
+		scene->setBVHThreads(value);
+}
+
+TileScheduler& RayTracer::getScheduler()
+{
+	if (scheduler == nullptr)
+		scheduler = new TileScheduler(numThreads);
+	return *scheduler;
+}
+
 void RayTracer::traceLines( int start, int stop )
 {
-	vec3f col;
+	startLines(start, stop);
+	getScheduler().wait();
+}
+
+void RayTracer::startLines( int start, int stop )
+{
 	if( !scene )
 		return;
 
 	if( stop > buffer_height )
 		stop = buffer_height;
 
-	for( int j = start; j < stop; ++j )
-		for( int i = 0; i < buffer_width; ++i )
+	getScheduler().start(0, start, buffer_width, stop, tileSize, tileSize,
+		[this](int x0, int y0, int x1, int y1) { traceTile(x0, y0, x1, y1); });
+}
+
+void RayTracer::traceTile( int x0, int y0, int x1, int y1 )
+{
+	// a packet goes through the BVHs at a single time
+	Camera* camera = scene->getCamera();
+	if (enablePackets && !enableMotionBlur && !enablePathTracing &&
+		camera->getShutterOpen() == camera->getShutterClose())
+	{
+		for (int j = y0; j < y1; j += packetSize)
+			for (int i = x0; i < x1; i += packetSize)
+				tracePacket(i, j, min(i + packetSize, x1), min(j + packetSize, y1));
+		return;
+	}
+
+	for( int j = y0; j < y1; ++j )
+		for( int i = x0; i < x1; ++i )
 			tracePixel(i, j, 1);
 }
 
+// tracePixel for a block of pixels, their rays for each SSAA sample are
+// found in a single pass through the BVHs
+void RayTracer::tracePacket( int x0, int y0, int x1, int y1 )
+{
+	if( !scene )
+		return;
+
+	int sampleNum = pow(2, ssaaSample);
+	auto pattern = msaaSamplePattern[ssaaSample];
+	double unitWidth = 0.0625 / double(buffer_width);		// 1/16
+	double unitHeight = 0.0625 / double(buffer_height);
+	bool terminated = 0 > maxDepth || (1.0 < threshold[0] && 1.0 < threshold[1] && 1.0 < threshold[2]);
+
+	RayPacket packet;
+	Isect isects[RayPacket::maxSize];
+	vec3f colors[RayPacket::maxSize];
+	Random rngs[RayPacket::maxSize];		// of the pixels, as tracePixel seeds them
+	for (int j = y0, k = 0; j < y1; ++j)
+		for (int i = x0; i < x1; ++i, ++k)
+			rngs[k].seed(i + j * buffer_width, 1);
+	for (int sample = 0; sample < sampleNum; ++sample)
+	{
+		packet.clear();
+		for (int j = y0; j < y1; ++j)
+		{
+			for (int i = x0; i < x1; ++i)
+			{
+				RandomScope scope(rngs[packet.size]);
+				double x = double(i) / double(buffer_width);
+				double y = double(j) / double(buffer_height);
+				if (!ssaaJitter)
+				{
+					x += pattern[sample].first * unitWidth;
+					y += pattern[sample].second * unitHeight;
+				}
+				else
+				{
+					x += getRandomReal() / buffer_width;
+					y += getRandomReal() / buffer_height;
+				}
+				Ray r;
+				scene->getCamera()->rayThrough(x, y, r);
+				packet.add(r);
+			}
+		}
+		if (terminated)
+			continue;
+		packet.computeBounds();
+
+		uint64_t hits = scene->bvhIntersect(packet, isects);
+		for (int k = 0; k < packet.size; ++k)
+		{
+			const Ray& r = packet.rays[k];
+			RandomScope scope(rngs[k]);
+			vec3f col = (hits >> k & 1) ? shadeHit(scene, r, isects[k], threshold, 0, {1.0, 1.0, 1.0}) : shadeMiss(scene, r);
+			colors[k] += col.clamp();
+		}
+	}
+
+	int k = 0;
+	for (int j = y0; j < y1; ++j)
+	{
+		for (int i = x0; i < x1; ++i, ++k)
+		{
+			vec3f col = colors[k] / sampleNum;
+			unsigned char *pixel = buffer + ( i + j * buffer_width ) * 3;
+			pixel[0] = (int)( 255.0 * col[0]);
+			pixel[1] = (int)( 255.0 * col[1]);
+			pixel[2] = (int)( 255.0 * col[2]);
+		}
+	}
+}
+
 void RayTracer::tracePixel( int i, int j, int iter )
 {
 	vec3f col;
@@ -443,6 +613,10 @@ void RayTracer::tracePixel( int i, int j, int iter )
 	if( !scene )
 		return;
 
+	// every pixel and pass draws its own sequence, whichever thread traces it
+	Random rng(i + j * buffer_width, iter);
+	RandomScope scope(rng);
+
 	double x = double(i)/double(buffer_width);
 	double y = double(j)/double(buffer_height);
 
@@ -464,11 +638,9 @@ void RayTracer::tracePixel( int i, int j, int iter )
 		}
 		else
 		{
-			double widthFactor = 1.0 / (double(RAND_MAX) * buffer_width);
-			double heightFactor = 1.0 / (double(RAND_MAX) * buffer_height);
 			for (int i = 0; i < sampleNum; ++i)
 			{
-				double xOffset = rand() * widthFactor, yOffset = rand() * heightFactor;
+				double xOffset = getRandomReal() / buffer_width, yOffset = getRandomReal() / buffer_height;
 				col += trace(scene, x + xOffset, y + yOffset);
 			}
 		}
@@ -500,50 +672,55 @@ void RayTracer::adaptiveTrace()
 	if (scene == nullptr)
 		return;
 
-	vector<vector<vec3f>> grid(buffer_height + 1);
-	for (int i = 0; i <= buffer_height; ++i)
+	vector<vector<vec3f>> grid(buffer_height + 1, vector<vec3f>(buffer_width + 1));
+	getScheduler().run(0, 0, buffer_width + 1, buffer_height + 1, tileSize, tileSize, [&](int x0, int y0, int x1, int y1)
 	{
-		grid[i].resize(buffer_width + 1);
-		#pragma omp parallel for num_threads(8)
-		for (int j = 0; j <= buffer_width; ++j)
-		{
-			double x = static_cast<double>(j) / buffer_width;
-			double y = static_cast<double>(i) / buffer_height;
-			grid[i][j] = trace(scene, x, y);
-		}
-	}
+		for (int i = y0; i < y1; ++i)
+			for (int j = x0; j < x1; ++j)
+			{
+				Random rng(j + i * (buffer_width + 1), 0);
+				RandomScope scope(rng);
+				double x = static_cast<double>(j) / buffer_width;
+				double y = static_cast<double>(i) / buffer_height;
+				grid[i][j] = trace(scene, x, y);
+			}
+	});
 
-	vector<vector<vec3f>> centers(buffer_height);
-	sampleNum.resize(buffer_height);
-	for (int i = 0; i < buffer_height; ++i)
+	vector<vector<vec3f>> centers(buffer_height, vector<vec3f>(buffer_width));
+	sampleNum.assign(buffer_height, vector<int>(buffer_width));
+	getScheduler().run(0, 0, buffer_width, buffer_height, tileSize, tileSize, [&](int x0, int y0, int x1, int y1)
 	{
-		centers[i].resize(buffer_width);
-		sampleNum[i].resize(buffer_width);
-		#pragma omp parallel for num_threads(8)
-		for (int j = 0; j < buffer_width; ++j)
-		{
-			double x = (static_cast<double>(j) + 0.5) / buffer_width;
-			double y = (static_cast<double>(i) + 0.5) / buffer_height;
-			centers[i][j] = trace(scene, x, y);
-		}
-	}
+		for (int i = y0; i < y1; ++i)
+			for (int j = x0; j < x1; ++j)
+			{
+				Random rng(j + i * buffer_width, 1);
+				RandomScope scope(rng);
+				double x = (static_cast<double>(j) + 0.5) / buffer_width;
+				double y = (static_cast<double>(i) + 0.5) / buffer_height;
+				centers[i][j] = trace(scene, x, y);
+			}
+	});
 
-	for (int i = 0; i < buffer_height; ++i)
-		#pragma omp parallel for num_threads(8)
-		for (int j = 0; j < buffer_width; ++j)
-		{
-			sampleNum[i][j] = 0;
-			double x = (static_cast<double>(j) + 0.5) / buffer_width;
-			double y = (static_cast<double>(i) + 0.5) / buffer_height;
-			vec3f c1 = subdivide(x, y, x - 0.5, y - 0.5, centers[i][j], grid[i][j], sampleNum[i][j], 0);
-			vec3f c2 = subdivide(x, y, x + 0.5, y - 0.5, centers[i][j], grid[i][j + 1], sampleNum[i][j], 0);
-			vec3f c3 = subdivide(x, y, x - 0.5, y + 0.5, centers[i][j], grid[i + 1][j], sampleNum[i][j], 0);
-			vec3f c4 = subdivide(x, y, x + 0.5, y + 0.5, centers[i][j], grid[i + 1][j + 1], sampleNum[i][j], 0);
-
-			unsigned char *pixel = buffer + ( j + i * buffer_width ) * 3;
-			vec3f c = (c1 + c2 + c3 + c4) * 0.25;
-			setPixel(j, i, c);
-		}
+	getScheduler().run(0, 0, buffer_width, buffer_height, tileSize, tileSize, [&](int x0, int y0, int x1, int y1)
+	{
+		for (int i = y0; i < y1; ++i)
+			for (int j = x0; j < x1; ++j)
+			{
+				Random rng(j + i * buffer_width, 2);
+				RandomScope scope(rng);
+				sampleNum[i][j] = 0;
+				double x = (static_cast<double>(j) + 0.5) / buffer_width;
+				double y = (static_cast<double>(i) + 0.5) / buffer_height;
+				vec3f c1 = subdivide(x, y, x - 0.5, y - 0.5, centers[i][j], grid[i][j], sampleNum[i][j], 0);
+				vec3f c2 = subdivide(x, y, x + 0.5, y - 0.5, centers[i][j], grid[i][j + 1], sampleNum[i][j], 0);
+				vec3f c3 = subdivide(x, y, x - 0.5, y + 0.5, centers[i][j], grid[i + 1][j], sampleNum[i][j], 0);
+				vec3f c4 = subdivide(x, y, x + 0.5, y + 0.5, centers[i][j], grid[i + 1][j + 1], sampleNum[i][j], 0);
+
+				unsigned char *pixel = buffer + ( j + i * buffer_width ) * 3;
+				vec3f c = (c1 + c2 + c3 + c4) * 0.25;
+				setPixel(j, i, c);
+			}
+	});
 }
 
 // (x1, y1) should be the coords of the center 
@@ -595,14 +772,92 @@ vec3f RayTracer::tracePixelMotionBlur(int i, int j)
 
 void RayTracer::pathTrace(int iter)
 {
-	for (int i = 0; i < buffer_height; ++i)
+	if (enableWavefront && !enableMotionBlur)
 	{
-		#pragma omp parallel for num_threads(4)
-		for (int j = 0; j < buffer_width; ++j)
+		pathTraceWavefront(iter);
+		return;
+	}
+
+	getScheduler().run(0, 0, buffer_width, buffer_height, tileSize, tileSize, [&](int x0, int y0, int x1, int y1)
+	{
+		for (int j = y0; j < y1; ++j)
+			for (int i = x0; i < x1; ++i)
+				tracePixel(i, j, iter);
+	});
+}
+
+// The camera rays of every SSAA sample of every pixel start paths, a block
+// of packetSize x packetSize pixels after the other, and the wavefront
+// traces them whenever it has a wave of them
+void RayTracer::pathTraceWavefront(int iter)
+{
+	if (scene == nullptr)
+		return;
+
+	int sampleNum = pow(2, ssaaSample);
+	auto pattern = msaaSamplePattern[ssaaSample];
+	double unitWidth = 0.0625 / double(buffer_width);		// 1/16
+	double unitHeight = 0.0625 / double(buffer_height);
+
+	wavefront.maxDepth = ptMaxDepth;
+	wavefront.rrThresh = rrThresh;
+	std::vector<vec3f> colors(buffer_width * buffer_height);
+	for (int y0 = 0; y0 < buffer_height; y0 += packetSize)
+	{
+		for (int x0 = 0; x0 < buffer_width; x0 += packetSize)
 		{
-			tracePixel(i, j, iter);
+			for (int sample = 0; sample < sampleNum; ++sample)
+			{
+				for (int j = y0; j < min(y0 + packetSize, buffer_height); ++j)
+				{
+					for (int i = x0; i < min(x0 + packetSize, buffer_width); ++i)
+					{
+						// a sequence for every sample of every pixel and pass, kept by the path
+						Random rng(i + j * buffer_width, uint64_t(iter) * sampleNum + sample);
+						RandomScope scope(rng);
+						double x = double(i) / double(buffer_width);
+						double y = double(j) / double(buffer_height);
+						if (!ssaaJitter)
+						{
+							x += pattern[sample].first * unitWidth;
+							y += pattern[sample].second * unitHeight;
+						}
+						else
+						{
+							x += getRandomReal() / buffer_width;
+							y += getRandomReal() / buffer_height;
+						}
+						Ray r;
+						scene->getCamera()->rayThrough(x, y, r);
+						wavefront.addPath(r, i + j * buffer_width, rng);
+					}
+				}
+				if (wavefront.size() >= Wavefront::waveSize)
+					wavefront.trace(scene, getScheduler(), colors, 1.0 / sampleNum);
+			}
 		}
 	}
+	wavefront.trace(scene, getScheduler(), colors, 1.0 / sampleNum);
+
+	double weight = (double)(iter - 1) / iter;
+	for (int k = 0; k < buffer_width * buffer_height; ++k)
+	{
+		const vec3f& col = colors[k];
+		unsigned char* pixel = buffer + k * 3;
+		unsigned char* backPixel = backBuffer + k * 3;
+		backPixel[0] = (int)( 255.0 * col[0] / iter + pixel[0] * weight );
+		backPixel[1] = (int)( 255.0 * col[1] / iter + pixel[1] * weight );
+		backPixel[2] = (int)( 255.0 * col[2] / iter + pixel[2] * weight );
+	}
+}
+
+void RayTracer::setBVHSplitMethod(BVH::SplitMethod method)
+{
+	bvhSplitMethod = method;
+	if (!m_bSceneLoaded)
+		return;
+	scene->setBVHSplitMethod(method);
+	scene->buildBVH();
 }
 
 void RayTracer::setLightScale(double value)
@@ -10,6 +10,8 @@
 #include "scene/Ray.h"
 #include "photon_map/Photon.h"
 #include "photon_map/KdTree.h"
+#include "Wavefront.h"
+#include "TileScheduler.h"
 
 class RayTracer
 {
@@ -20,18 +22,23 @@ public:
 
     vec3f trace( Scene *scene, double x, double y );
 	vec3f traceRay( Scene *scene, const Ray& r, const vec3f& thresh, int depth, const vec3f& curFactor );
+	vec3f shadeHit( Scene *scene, const Ray& r, const Isect& i, const vec3f& thresh, int depth, const vec3f& curFactor );
+	vec3f shadeMiss( Scene *scene, const Ray& r );
 	vec3f tracePath(Scene* scene, const Ray& ray, int depth);		// path tracing
 	
 	void buildPhotonMap();
-	void tracePhoton(Photon* cur);
+	void tracePhoton(Ray ray, vec3f power, std::vector<Photon>& stored) const;
 	vec3f gatherPhoton(const vec3f& pos);
 
 	void getBuffer( unsigned char *&buf, int &w, int &h );
 	void swapBuffer();
 	double aspectRatio();
 	void traceSetup( int w, int h, int maxDepth, const vec3f& threshold );
-	void traceLines( int start = 0, int stop = 10000000 );
+	void traceLines( int start = 0, int stop = 10000000 );		// on the render threads, returns when done
+	void startLines( int start = 0, int stop = 10000000 );		// returns at once, see getScheduler()
 	void tracePixel( int i, int j, int iter );
+	void traceTile( int x0, int y0, int x1, int y1 );		// the pixels of [x0, x1) x [y0, y1)
+	void tracePacket( int x0, int y0, int x1, int y1 );
 
 	// Adaptive supersampling
 	void adaptiveTrace();
@@ -41,6 +48,7 @@ public:
 	
 	vec3f tracePixelMotionBlur(int i, int j);
 	void pathTrace(int iter);
+	void pathTraceWavefront(int iter);		// pathTrace with all the paths of a wave at once
 	void setLightScale(double value);
 
 	// Depth of field
@@ -60,6 +68,22 @@ public:
 
 	void setFasterShadow(bool i) { scene->enableFasterShadow = i; }
 
+	// Acceleration structure
+	void setBVHSplitMethod(BVH::SplitMethod method);
+	double getBVHCost() const { return m_bSceneLoaded ? scene->getBVHCost() : 0.0; }
+	BVH::SplitMethod bvhSplitMethod{BVH::SplitMethod::SAH};
+	string bvhCacheDir;		// keep built BVHs in files there if not empty
+
+	// traceLines traces the camera rays of packetSize x packetSize pixels
+	// together, unless there is motion blur or path tracing
+	bool enablePackets{true};
+	static const int packetSize{8};
+
+	// Rendering goes tile by tile on a pool of threads
+	void setNumThreads(int value);		// one per core if value <= 0
+	TileScheduler& getScheduler();
+	static const int tileSize{32};
+
 	int ssaaSample{0};	// the exponent of 2
 	bool ssaaJitter{false};
 
@@ -78,6 +102,7 @@ public:
 	bool enablePathTracing{false};
 	int SPP{64};		// sample per pixel
 	double rrThresh{0.7};	// russian roulette threshold
+	bool enableWavefront{false};	// breadth-first, see Wavefront
 
 	// Photon mapping
 	bool enablePM{false};
@@ -96,8 +121,11 @@ private:
 	int bufferSize;
 	Scene *scene;
 
+	TileScheduler* scheduler{nullptr};
+	int numThreads{0};
+
 	KdTree* kdTree{nullptr};
-	std::vector<Photon*> photonMap;
+	Wavefront wavefront;
 
 	HFmap* hfmap{ nullptr };
 
@@ -9,7 +9,7 @@ CSG::~CSG()
 	delete material;
 }
 
-bool CSG::intersect(const Ray& ray, Isect& isect) const
+bool CSG::intersectHit(const Ray& ray, Isect& isect) const
 {
 	vector<Isect> l, r;
 	getAllIsect(ray, l, left);
@@ -12,7 +12,7 @@ public:
 
 	CSG(Scene* scene);
 	~CSG();
-	bool intersect(const Ray& ray, Isect& isect) const override;		// only need to return when finding the first intersection
+	bool intersectHit(const Ray& ray, Isect& isect) const override;		// the complete hit, only need to return when finding the first intersection
 	void intersectCSG(const Ray& ray, std::vector<Isect>& list) const;	// return the whole Roth diagram to avoid redundant computation
 	bool intersectLocal(const Ray& ray, Isect& isect) const override;
 	bool hasBoundingBoxCapability() const override;
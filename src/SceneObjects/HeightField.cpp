@@ -0,0 +1,304 @@
+#include <cmath>
+#include "HeightField.h"
+
+HeightField::HeightField( Scene *scene, Material *mat, TransformNode *transform, const HFmap* map )
+	: MaterialSceneObject( scene, mat ), map( map ), width( map->width ), height( map->height )
+{
+	this->transform = transform;
+
+	// placed and scaled as the mesh processHField used to build
+	originX = -(width / 2) / 100.0 - 2.0;
+	originZ = -(height / 2) / 100.0 - 2.0;
+	heights.resize(width * height);
+	for (int z = 0; z < height; ++z)
+	{
+		for (int x = 0; x < width; ++x)
+			heights[z * width + x] = float((map->getH(x, z) * width / 255.0 / 100.0 - width / 200.0 - 2) * 0.2);
+	}
+	if (!hasBoundingBoxCapability())
+		return;
+
+	// the finest level from the samples, every other one from the level below
+	int cellsX = width - 1, cellsZ = height - 1;
+	Level level;
+	level.width = (cellsX + 1) / 2;
+	level.height = (cellsZ + 1) / 2;
+	level.low.resize(level.width * level.height);
+	level.high.resize(level.width * level.height);
+	for (int bz = 0; bz < level.height; ++bz)
+	{
+		for (int bx = 0; bx < level.width; ++bx)
+		{
+			float low = heightAt(2 * bx, 2 * bz), high = low;
+			for (int z = 2 * bz; z <= _min(2 * bz + 2, cellsZ); ++z)
+			{
+				for (int x = 2 * bx; x <= _min(2 * bx + 2, cellsX); ++x)
+				{
+					low = _min(low, heightAt(x, z));
+					high = _max(high, heightAt(x, z));
+				}
+			}
+			level.low[bz * level.width + bx] = low;
+			level.high[bz * level.width + bx] = high;
+		}
+	}
+	levels.push_back(level);
+
+	while (levels.back().width > 1 || levels.back().height > 1)
+	{
+		const Level& fine = levels.back();
+		Level coarse;
+		coarse.width = (fine.width + 1) / 2;
+		coarse.height = (fine.height + 1) / 2;
+		coarse.low.resize(coarse.width * coarse.height);
+		coarse.high.resize(coarse.width * coarse.height);
+		for (int bz = 0; bz < coarse.height; ++bz)
+		{
+			for (int bx = 0; bx < coarse.width; ++bx)
+			{
+				float low = fine.low[2 * bz * fine.width + 2 * bx], high = fine.high[2 * bz * fine.width + 2 * bx];
+				for (int z = 2 * bz; z < _min(2 * bz + 2, fine.height); ++z)
+				{
+					for (int x = 2 * bx; x < _min(2 * bx + 2, fine.width); ++x)
+					{
+						low = _min(low, fine.low[z * fine.width + x]);
+						high = _max(high, fine.high[z * fine.width + x]);
+					}
+				}
+				coarse.low[bz * coarse.width + bx] = low;
+				coarse.high[bz * coarse.width + bx] = high;
+			}
+		}
+		levels.push_back(coarse);
+	}
+}
+
+BoundingBox HeightField::ComputeLocalBoundingBox()
+{
+	BoundingBox localbounds;
+	if (levels.empty())
+		return localbounds;
+	localbounds.min = vec3f(originX, levels.back().low[0], originZ);
+	localbounds.max = vec3f(originX + (width - 1) * spacing, levels.back().high[0], originZ + (height - 1) * spacing);
+	return localbounds;
+}
+
+vec3f HeightField::sample( int x, int z ) const
+{
+	return vec3f(originX + x * spacing, heightAt(x, z), originZ + z * spacing);
+}
+
+// One-sided Moller-Trumbore, with the same front facing test as a Trimesh
+static bool intersectTriangle( const Ray& r, const vec3f& a, const vec3f& b, const vec3f& c, double& t, vec3f& bary )
+{
+	vec3f e1 = b - a, e2 = c - a;
+	vec3f p = r.getDirection().cross(e2);
+	double det = e1 * p;
+	if (det <= 0.0 || det * det <= NORMAL_EPSILON * NORMAL_EPSILON * e1.cross(e2).length_squared())
+		return false;
+	vec3f s = r.getPosition() - a;
+	double u = (s * p) / det;
+	if (u < 0.0 || u > 1.0)
+		return false;
+	vec3f q = s.cross(e1);
+	double v = (r.getDirection() * q) / det;
+	if (v < 0.0 || u + v > 1.0)
+		return false;
+	t = (e2 * q) / det;
+	if (t < RAY_EPSILON)
+		return false;
+	bary = vec3f(1.0 - u - v, u, v);
+	return true;
+}
+
+// Cell (x, z) is split along the diagonal from sample (x, z) to (x + 1, z + 1),
+// prim counts the triangles of the cells row by row
+bool HeightField::intersectCell( int x, int z, const Ray& r, double& t, int& prim, vec3f& bary ) const
+{
+	vec3f a = sample(x, z), c = sample(x + 1, z + 1);
+	double tTri;
+	vec3f baryTri;
+	bool hit = false;
+	if (intersectTriangle(r, a, sample(x, z + 1), c, tTri, baryTri))
+	{
+		t = tTri;
+		bary = baryTri;
+		prim = 2 * (z * (width - 1) + x);
+		hit = true;
+	}
+	if (intersectTriangle(r, a, c, sample(x + 1, z), tTri, baryTri) && (!hit || tTri < t))
+	{
+		t = tTri;
+		bary = baryTri;
+		prim = 2 * (z * (width - 1) + x) + 1;
+		hit = true;
+	}
+	return hit;
+}
+
+// 2D DDA over the cells, on the coarsest level of the pyramid whose block the
+// ray passes above or below, descending wherever it doesn't and climbing again
+// once it leaves the block.  The cells come in the order the ray crosses them,
+// so the first one hit has the closest hit.
+bool HeightField::intersectLocal( const Ray& r, Isect& i ) const
+{
+	if (levels.empty())
+		return false;
+
+	// in units of the sample spacing across, t stays the same
+	const vec3f& pos = r.getPosition();
+	const vec3f& dir = r.getDirection();
+	double o[3] = {(pos[0] - originX) / spacing, pos[1], (pos[2] - originZ) / spacing};
+	double d[3] = {dir[0] / spacing, dir[1], dir[2] / spacing};
+	int cellsX = width - 1, cellsZ = height - 1;
+
+	// clip to the whole field
+	double low[3] = {0.0, levels.back().low[0], 0.0};
+	double high[3] = {double(cellsX), levels.back().high[0], double(cellsZ)};
+	double t = 0.0, tEnd = 1.0e308;
+	for (int k = 0; k < 3; ++k)
+	{
+		if (d[k] == 0.0)
+		{
+			if (o[k] < low[k] || o[k] > high[k])
+				return false;
+			continue;
+		}
+		double t0 = (low[k] - o[k]) / d[k];
+		double t1 = (high[k] - o[k]) / d[k];
+		if (t0 > t1)
+			std::swap(t0, t1);
+		t = _max(t, t0);
+		tEnd = _min(tEnd, t1);
+	}
+	if (t > tEnd)
+		return false;
+
+	double invX = 1.0 / d[0], invZ = 1.0 / d[2];
+	int cellX = _min(_max(int(floor(o[0] + d[0] * t)), 0), cellsX - 1);
+	int cellZ = _min(_max(int(floor(o[2] + d[2] * t)), 0), cellsZ - 1);
+	int top = levels.size() - 1;
+	int level = top;		// -1 for single cells
+	while (true)
+	{
+		int shift = level + 1;
+		int x0 = (cellX >> shift) << shift, z0 = (cellZ >> shift) << shift;
+		int x1 = _min(x0 + (1 << shift), cellsX), z1 = _min(z0 + (1 << shift), cellsZ);
+		double tX = d[0] > 0.0 ? (x1 - o[0]) * invX : d[0] < 0.0 ? (x0 - o[0]) * invX : 1.0e308;
+		double tZ = d[2] > 0.0 ? (z1 - o[2]) * invZ : d[2] < 0.0 ? (z0 - o[2]) * invZ : 1.0e308;
+		double tExit = _min(_min(tX, tZ), tEnd);
+
+		float blockLow, blockHigh;
+		if (level < 0)
+		{
+			blockLow = _min(_min(heightAt(cellX, cellZ), heightAt(cellX + 1, cellZ)),
+				_min(heightAt(cellX, cellZ + 1), heightAt(cellX + 1, cellZ + 1)));
+			blockHigh = _max(_max(heightAt(cellX, cellZ), heightAt(cellX + 1, cellZ)),
+				_max(heightAt(cellX, cellZ + 1), heightAt(cellX + 1, cellZ + 1)));
+		}
+		else
+		{
+			const Level& blocks = levels[level];
+			int index = (cellZ >> shift) * blocks.width + (cellX >> shift);
+			blockLow = blocks.low[index];
+			blockHigh = blocks.high[index];
+		}
+		double yEnter = o[1] + d[1] * t, yExit = o[1] + d[1] * tExit;
+		if (_max(yEnter, yExit) >= blockLow && _min(yEnter, yExit) <= blockHigh)
+		{
+			if (level >= 0)
+			{
+				--level;
+				continue;
+			}
+			double tHit;
+			int prim;
+			vec3f bary;
+			if (intersectCell(cellX, cellZ, r, tHit, prim, bary))
+			{
+				i.t = tHit;
+				i.prim = prim;
+				i.bary = bary;
+				i.obj = this;
+				return true;
+			}
+		}
+
+		// on to the next block, the axis crossed first steps exactly
+		if (tExit >= tEnd)
+			return false;
+		int prevX = cellX, prevZ = cellZ;
+		if (tX <= tZ)
+		{
+			cellX = d[0] > 0.0 ? x1 : x0 - 1;
+			cellZ = _min(_max(int(floor(o[2] + d[2] * tExit)), z0), z1 - 1);
+		}
+		else
+		{
+			cellZ = d[2] > 0.0 ? z1 : z0 - 1;
+			cellX = _min(_max(int(floor(o[0] + d[0] * tExit)), x0), x1 - 1);
+		}
+		if (cellX < 0 || cellX >= cellsX || cellZ < 0 || cellZ >= cellsZ)
+			return false;
+		t = tExit;
+		// climb to the blocks left, only within them did the ray overlap
+		while (level < top && ((cellX >> (level + 2)) != (prevX >> (level + 2)) ||
+			(cellZ >> (level + 2)) != (prevZ >> (level + 2))))
+			++level;
+	}
+}
+
+vec3f HeightField::faceNormal( int x, int z, int tri ) const
+{
+	vec3f a = sample(x, z), c = sample(x + 1, z + 1);
+	vec3f b = tri == 0 ? sample(x, z + 1) : c;
+	if (tri == 1)
+		c = sample(x + 1, z);
+	return (b - a).cross(c - a).normalize();
+}
+
+vec3f HeightField::sampleNormal( int x, int z ) const
+{
+	vec3f sum;
+	int count = 0;
+	auto add = [&](int cellX, int cellZ, int tri)
+	{
+		if (cellX >= 0 && cellZ >= 0 && cellX < width - 1 && cellZ < height - 1)
+		{
+			sum += faceNormal(cellX, cellZ, tri);
+			++count;
+		}
+	};
+	add(x, z, 0);
+	add(x, z, 1);
+	add(x, z - 1, 0);
+	add(x - 1, z - 1, 0);
+	add(x - 1, z - 1, 1);
+	add(x - 1, z, 1);
+	return count > 0 ? sum / count : sum;
+}
+
+void HeightField::computeLocalSurface( Isect& i ) const
+{
+	int cell = i.prim / 2;
+	int x = cell % (width - 1), z = cell / (width - 1);
+	int cornerX[3] = {x, x, x + 1}, cornerZ[3] = {z, z + 1, z + 1};
+	if (i.prim % 2 == 1)
+	{
+		cornerX[1] = x + 1;
+		cornerX[2] = x + 1;
+		cornerZ[2] = z;
+	}
+
+	vec3f normal, diffuse;
+	for (int k = 0; k < 3; ++k)
+	{
+		normal += i.bary[k] * sampleNormal(cornerX[k], cornerZ[k]);
+		diffuse += i.bary[k] * map->getC(cornerX[k], cornerZ[k]) / 255.0;
+	}
+	i.setN(normal.normalize());
+
+	Material m = getMaterial();
+	m.kd = diffuse;
+	i.setMaterial(m);
+}
@@ -0,0 +1,46 @@
+#ifndef __HEIGHTFIELD_H__
+#define __HEIGHTFIELD_H__
+
+#include <vector>
+
+#include "../scene/scene.h"
+
+// Terrain from a height field map, a grid of samples with two triangles per
+// cell, the same ones processHField used to build a Trimesh of.  Only the
+// heights and a min/max pyramid over blocks of cells are kept, normals and
+// colors are looked up at the samples of the hit cell when it is shaded.
+class HeightField
+	: public MaterialSceneObject
+{
+public:
+	HeightField( Scene *scene, Material *mat, TransformNode *transform, const HFmap* map );
+
+	bool intersectLocal( const Ray& r, Isect& i ) const override;
+	void computeLocalSurface( Isect& i ) const override;
+	bool hasBoundingBoxCapability() const override { return width > 1 && height > 1; }
+	BoundingBox ComputeLocalBoundingBox() override;
+
+protected:
+	// Height of sample (x, z)
+	float heightAt( int x, int z ) const { return heights[z * width + x]; }
+	vec3f sample( int x, int z ) const;
+	bool intersectCell( int x, int z, const Ray& r, double& t, int& prim, vec3f& bary ) const;
+	vec3f faceNormal( int x, int z, int tri ) const;
+	vec3f sampleNormal( int x, int z ) const;		// averaged over the faces around it, as Trimesh::generateNormals
+
+	// Blocks of 2 << level cells on a side, each with the lowest and highest sample in it
+	struct Level
+	{
+		int width, height;
+		std::vector<float> low, high;
+	};
+
+	const HFmap* map;
+	int width, height;			// in samples
+	double originX, originZ;	// position of sample (0, 0)
+	double spacing{0.01};		// between samples
+	std::vector<float> heights;
+	std::vector<Level> levels;
+};
+
+#endif // __HEIGHTFIELD_H__
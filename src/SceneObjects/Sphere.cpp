@@ -85,7 +85,7 @@ Ray SphereLight::sample(vec3f& emit, double& pdf) const
 }
 
 
-bool MovingSphere::intersect(const Ray& r, Isect& i) const
+bool MovingSphere::intersectHit(const Ray& r, Isect& i) const
 {
 	vec3f center = getCurPosition(r.getTime());
 	vec3f normal = r.normalToPoint(center);
@@ -98,6 +98,8 @@ bool MovingSphere::intersect(const Ray& r, Isect& i) const
 		return false;
 	i.N = (isectPos - center).normalize();
 	i.obj = this;
+	i.clearMaterial();
+	i.local = false;
 	setTexCoords(i);
 	return true;
 }
@@ -110,3 +112,34 @@ vec3f MovingSphere::getCurPosition(double time) const
 		return target;
 	return (target - pos) / (time1 - time0) * (time - time0) + pos;
 }
+
+BoundingBox MovingSphere::boundsAt(const vec3f& center) const
+{
+	BoundingBox box;
+	box.min = center - vec3f(radius, radius, radius);
+	box.max = center + vec3f(radius, radius, radius);
+	return box;
+}
+
+void MovingSphere::ComputeBoundingBox()
+{
+	bounds = boundsAt(pos);
+	bounds.merge(boundsAt(target));
+}
+
+bool MovingSphere::getMotionBounds(double open, double close, MotionBounds& motion) const
+{
+	// the center only moves linearly between time0 and time1, over a longer
+	// shutter interpolated bounds would miss it
+	if (time1 != time0 && (open < time0 || close > time1))
+	{
+		motion.open = bounds;
+		motion.close = bounds;
+	}
+	else
+	{
+		motion.open = boundsAt(getCurPosition(open));
+		motion.close = boundsAt(getCurPosition(close));
+	}
+	return true;
+}
@@ -35,12 +35,14 @@ public:
 	MovingSphere(Scene* scene, Material* material, const vec3f& pos, const vec3f& target, double radius, double time0, double time1):
 		Sphere(scene, material), pos(pos), target(target), radius(radius), time0(time0), time1(time1) { }
 
-	bool intersect(const Ray& r, Isect& i) const override;
-	bool hasBoundingBoxCapability() const override { return false; }
-	void ComputeBoundingBox() override { }
+	bool intersectHit(const Ray& r, Isect& i) const override;		// in world space, ignores the transform
+	bool hasBoundingBoxCapability() const override { return true; }
+	void ComputeBoundingBox() override;		// covers the whole path
+	bool getMotionBounds(double open, double close, MotionBounds& motion) const override;
 
 private:
 	vec3f getCurPosition(double time) const;
+	BoundingBox boundsAt(const vec3f& center) const;
 	
 	vec3f pos, target;
 	double radius;
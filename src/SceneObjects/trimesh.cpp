@@ -1,6 +1,8 @@
 #include <cmath>
+#include <cstring>
 #include <float.h>
 #include "trimesh.h"
+#include "../scene/bvhcache.h"
 
 Trimesh::~Trimesh()
 {
@@ -8,10 +10,16 @@ Trimesh::~Trimesh()
     {
         delete *i;
     }
-    for (Faces::iterator i = faces.begin(); i != faces.end(); ++i)
-    {
-        delete* i;
-    }
+}
+
+void Trimesh::reserve( int numVertices, int numFaces, bool withNormals, bool withTexCoords )
+{
+	vertices.reserve(numVertices);
+	faces.reserve(numFaces);
+	if (withNormals)
+		normals.reserve(numVertices);
+	if (withTexCoords)
+		texCoords.reserve(numVertices);
 }
 
 // must add vertices, normals, and materials IN ORDER
@@ -42,11 +50,8 @@ void Trimesh::addTexCoords(const TexCoords& coords)
 
 void Trimesh::setEmission(const vec3f& emit)
 {
-	for (auto* face : faces)
-	{
-		face->hasEmission = true;
-		face->emission = emit;
-	}
+	hasEmission = true;
+	emission = emit;
 }
 
 // Returns false if the vertices a,b,c don't all exist
@@ -57,11 +62,7 @@ bool Trimesh::addFace( int a, int b, int c )
     if( a >= vcnt || b >= vcnt || c >= vcnt )
         return false;
 
-    // TrimeshFace *newFace = new TrimeshFace( scene, new Material(*this->material), this, a, b, c );
-	TrimeshFace *newFace = new TrimeshFace( scene, material, this, a, b, c );
-    newFace->setTransform(this->transform);
-    faces.push_back( newFace );
-    scene->add(newFace);
+    faces.emplace_back( a, b, c );
     return true;
 }
 
@@ -79,114 +80,610 @@ Trimesh::doubleCheck()
     return 0;
 }
 
-// Intersect ray r with the triangle abc.  If it hits returns true,
-// and put the parameter in t and the barycentric coordinates of the
-// intersection in bary.
-// Uses the algorithm and notation from _Graphic Gems 5_, p. 232.
-//
-// Calculates and returns the normal of the triangle too.
-bool TrimeshFace::intersectLocal( const Ray& r, Isect& i ) const
+void Trimesh::setVertex( int i, const vec3f &v )
 {
-    const vec3f& a = parent->vertices[ids[0]];
-    const vec3f& b = parent->vertices[ids[1]];
-    const vec3f& c = parent->vertices[ids[2]];
-    
-    vec3f bary;
-    float t;
-    vec3f n;
-    
-    vec3f p = r.getPosition();
-    vec3f v = r.getDirection();
-    
-    vec3f ab = b - a;
-    vec3f ac = c - a;
-    vec3f ap = p - a;
-    
-	vec3f cv=ab.cross(ac);
-
-	// there exists some bad triangles such that two vertices coincide
-	// check this before normalize
-	if (cv.iszero()) return false;
-    n = (cv).normalize();
-	
-    double vdotn = v*n;
-    if( -vdotn < NORMAL_EPSILON )
-        return false;
-    
-    t = - (ap*n)/vdotn;
-    
-    if( t < RAY_EPSILON )
-        return false;
+	expandVertices();
+	vertices[i] = v;
+}
 
-    // find k where k is the index of the component
-    // of normal vector with greatest absolute value
-    float greatestMag = FLT_MIN;
-    int k = -1;
-    for( int j = 0; j < 3; ++j )
-    {
-        float val = n[j];
-        if( val < 0 )
-            val *= -1;
-        if( val > greatestMag )
-        {
-            k = j;
-            greatestMag = val;
-        }
-    }
+// Half floats, rounded to the nearest
+static uint16_t floatToHalf( float value )
+{
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	uint16_t sign = (bits >> 16) & 0x8000;
+	int exponent = int((bits >> 23) & 0xff) - 127 + 15;
+	uint32_t mantissa = bits & 0x7fffff;
+	if (exponent >= 31)
+		return sign | (((bits >> 23) & 0xff) == 0xff && mantissa != 0 ? 0x7e00 : 0x7c00);
+	int shift = 13;
+	uint32_t half;
+	if (exponent <= 0)
+	{
+		if (exponent < -10)
+			return sign;
+		mantissa |= 0x800000;
+		shift = 14 - exponent;
+		half = mantissa >> shift;
+	}
+	else
+		half = (uint32_t(exponent) << 10) | (mantissa >> shift);
+	uint32_t rest = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+	if (rest > halfway || (rest == halfway && (half & 1)))
+		++half;		// a carry into the exponent is still right
+	return sign | uint16_t(half);
+}
+
+static float halfToFloat( uint16_t half )
+{
+	uint32_t sign = uint32_t(half & 0x8000) << 16;
+	uint32_t exponent = (half >> 10) & 0x1f, mantissa = half & 0x3ff;
+	if (exponent == 0)
+		return (sign ? -1.0f : 1.0f) * float(mantissa) * (1.0f / 16777216.0f);
+	uint32_t bits = sign | (exponent == 31 ? 0x7f800000 : (exponent + 112) << 23) | (mantissa << 13);
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+// Octahedral normals, the direction projected onto the octahedron and its
+// lower half folded over the upper one, 16 bits a coordinate
+static uint32_t encodeNormal( const vec3f& n )
+{
+	double sum = fabs(n[0]) + fabs(n[1]) + fabs(n[2]);
+	double x = sum > 0.0 ? n[0] / sum : 0.0, y = sum > 0.0 ? n[1] / sum : 0.0;
+	if (n[2] < 0.0)
+	{
+		double folded = (1.0 - fabs(y)) * (x >= 0.0 ? 1.0 : -1.0);
+		y = (1.0 - fabs(x)) * (y >= 0.0 ? 1.0 : -1.0);
+		x = folded;
+	}
+	auto snorm = [](double v) { return uint32_t(uint16_t(int16_t(floor(_min(_max(v, -1.0), 1.0) * 32767.0 + 0.5)))); };
+	return snorm(x) | (snorm(y) << 16);
+}
+
+static vec3f decodeNormal( uint32_t code )
+{
+	double x = int16_t(code & 0xffff) / 32767.0, y = int16_t(code >> 16) / 32767.0;
+	double z = 1.0 - fabs(x) - fabs(y);
+	if (z < 0.0)
+	{
+		double folded = (1.0 - fabs(y)) * (x >= 0.0 ? 1.0 : -1.0);
+		y = (1.0 - fabs(x)) * (y >= 0.0 ? 1.0 : -1.0);
+		x = folded;
+	}
+	return vec3f(x, y, z).normalize();
+}
+
+vec3f Trimesh::vertex( int i ) const
+{
+	if (!compacted)
+		return vertices[i];
+	if (vertexFormat == VertexFormat::Float)
+		return vec3f(compact.positions[3 * i], compact.positions[3 * i + 1], compact.positions[3 * i + 2]);
+	const uint16_t* q = &compact.quantized[3 * i];
+	return vec3f(compact.origin[0] + q[0] * compact.step[0], compact.origin[1] + q[1] * compact.step[1],
+		compact.origin[2] + q[2] * compact.step[2]);
+}
+
+vec3f Trimesh::normal( int i ) const
+{
+	return compacted ? decodeNormal(compact.normals[i]) : normals[i];
+}
+
+TexCoords Trimesh::texCoord( int i ) const
+{
+	if (!compacted)
+		return texCoords[i];
+	return TexCoords(halfToFloat(compact.texCoords[2 * i]), halfToFloat(compact.texCoords[2 * i + 1]));
+}
+
+// Moves the vertex attributes to the compact format, if the mesh uses one
+void Trimesh::compactVertices()
+{
+	if (compacted || vertexFormat == VertexFormat::Double)
+		return;
+
+	int n = vertices.size();
+	if (vertexFormat == VertexFormat::Float)
+	{
+		compact.positions.resize(3 * n);
+		for (int i = 0; i < n; ++i)
+		{
+			for (int k = 0; k < 3; ++k)
+				compact.positions[3 * i + k] = float(vertices[i][k]);
+		}
+	}
+	else
+	{
+		vec3f low = n > 0 ? vertices[0] : vec3f(), high = low;
+		for (const auto& v : vertices)
+		{
+			low = minimum(low, v);
+			high = maximum(high, v);
+		}
+		compact.origin = low;
+		compact.step = (high - low) / 65535.0;
+		compact.quantized.resize(3 * n);
+		for (int i = 0; i < n; ++i)
+		{
+			for (int k = 0; k < 3; ++k)
+			{
+				double cell = compact.step[k] > 0.0 ? (vertices[i][k] - low[k]) / compact.step[k] : 0.0;
+				compact.quantized[3 * i + k] = uint16_t(_min(floor(cell + 0.5), 65535.0));
+			}
+		}
+	}
+	compact.normals.resize(normals.size());
+	for (int i = 0; i < int(normals.size()); ++i)
+		compact.normals[i] = encodeNormal(normals[i]);
+	compact.texCoords.resize(2 * texCoords.size());
+	for (int i = 0; i < int(texCoords.size()); ++i)
+	{
+		compact.texCoords[2 * i] = floatToHalf(float(texCoords[i].u));
+		compact.texCoords[2 * i + 1] = floatToHalf(float(texCoords[i].v));
+	}
+
+	Vertices().swap(vertices);
+	Normals().swap(normals);
+	std::vector<TexCoords>().swap(texCoords);
+	compacted = true;
+}
+
+// Back to doubles, for vertices to be moved
+void Trimesh::expandVertices()
+{
+	if (!compacted)
+		return;
+	int n = compact.positions.size() / 3 + compact.quantized.size() / 3;
+	vertices.resize(n);
+	for (int i = 0; i < n; ++i)
+		vertices[i] = vertex(i);
+	normals.resize(compact.normals.size());
+	for (int i = 0; i < int(normals.size()); ++i)
+		normals[i] = normal(i);
+	texCoords.resize(compact.texCoords.size() / 2);
+	for (int i = 0; i < int(texCoords.size()); ++i)
+		texCoords[i] = texCoord(i);
+
+	compact = CompactVertices();
+	compacted = false;
+}
+
+void Trimesh::buildBVH(BVHCache* cache)
+{
+	// the BVH and the packets are built from the vertices as they will be shaded
+	compactVertices();
+
+	// spatial splits clip the faces, so the tree depends on more than their boxes
+	uint64_t key = 0;
+	for (const auto& face : faces)
+	{
+		for (int k = 0; k < 3; ++k)
+		{
+			vec3f p = vertex(face[k]);
+			key = BVHCache::hash(p.n, sizeof(p.n), key);
+		}
+	}
+	bvh.contentKey = key;
+	bvh.cache = cache;
+	bvh.build(faceBoundingBoxes(), [this](int f, const BoundingBox& box, int axis, double pos,
+		BoundingBox& left, BoundingBox& right)
+	{
+		clipFace(f, box, axis, pos, left, right);
+	});
+	bvh.cache = nullptr;
+	updateFaces();
+}
+
+void Trimesh::setBVHSplitMethod(BVH::SplitMethod method)
+{
+	if (bvh.splitMethod == method)
+		return;
+	bvh.splitMethod = method;
+	if (!bvh.nodes.empty())
+		buildBVH(nullptr);
+}
+
+void Trimesh::refitBVH()
+{
+	compactVertices();
+	vector<BoundingBox> faceBoxes = faceBoundingBoxes();
+	vector<BoundingBox> slotBoxes;
+	slotBoxes.reserve(leafFaces.size());
+	for (int f : leafFaces)
+		slotBoxes.push_back(faceBoxes[f]);
+	if (bvh.refit(slotBoxes))
+	{
+		for (int& slot : bvh.order)
+			slot = leafFaces[slot];		// the face in the old slot
+	}
+	updateFaces();
+	Geometry::ComputeBoundingBox();
+}
+
+vector<BoundingBox> Trimesh::faceBoundingBoxes() const
+{
+	vector<BoundingBox> boxes;
+	boxes.reserve(faces.size());
+	for (const auto& face : faces)
+		boxes.push_back(faceBoundingBox(face));
+	return boxes;
+}
+
+// The faces in the slab test of the SBVH builder: the parts of the triangle on
+// either side of the plane are bounded by the vertices there and the points
+// where the edges cross it, then clipped to the box of the reference.
+void Trimesh::clipFace( int f, const BoundingBox& box, int axis, double pos, BoundingBox& left, BoundingBox& right ) const
+{
+	left = BoundingBox::emptyBox();
+	right = BoundingBox::emptyBox();
+	auto grow = [](BoundingBox& bounds, const vec3f& p)
+	{
+		bounds.min = minimum(bounds.min, p);
+		bounds.max = maximum(bounds.max, p);
+	};
+	for (int i = 0; i < 3; ++i)
+	{
+		vec3f a = vertex(faces[f][i]);
+		vec3f b = vertex(faces[f][(i + 1) % 3]);
+		if (a[axis] <= pos)
+			grow(left, a);
+		if (a[axis] >= pos)
+			grow(right, a);
+		if ((a[axis] < pos && b[axis] > pos) || (a[axis] > pos && b[axis] < pos))
+		{
+			vec3f p = a + (b - a) * ((pos - a[axis]) / (b[axis] - a[axis]));
+			p[axis] = pos;
+			grow(left, p);
+			grow(right, p);
+		}
+	}
+	left = left.overlap(box);
+	right = right.overlap(box);
+}
+
+void Trimesh::updateFaces()
+{
+	// store the faces in the order the leaves first use them
+	if (!bvh.order.empty())
+	{
+		vector<int> newIndex(faces.size(), -1);
+		Faces ordered;
+		ordered.reserve(faces.size());
+		leafFaces.resize(bvh.order.size());
+		for (size_t slot = 0; slot < bvh.order.size(); ++slot)
+		{
+			int prim = bvh.order[slot];
+			if (newIndex[prim] < 0)
+			{
+				newIndex[prim] = ordered.size();
+				ordered.push_back(faces[prim]);
+			}
+			leafFaces[slot] = newIndex[prim];
+		}
+		faces.swap(ordered);
+		bvh.order.clear();
+	}
+
+	areaCdf.resize(faces.size());
+	area = 0.0;
+	for (size_t i = 0; i < faces.size(); ++i)
+	{
+		vec3f a = vertex(faces[i][0]);
+		area += (vertex(faces[i][1]) - a).cross(vertex(faces[i][2]) - a).length() * 0.5;
+		areaCdf[i] = area;
+	}
+
+	packFaces();
+}
+
+void Trimesh::packFaces()
+{
+	int n = leafFaces.size() + 3;
+	for (int k = 0; k < 3; ++k)
+	{
+		packets.v0[k].assign(n, 0.0f);
+		packets.e1[k].assign(n, 0.0f);
+		packets.e2[k].assign(n, 0.0f);
+	}
+	packets.minDet.assign(n, FLT_MAX);
+	for (size_t slot = 0; slot < leafFaces.size(); ++slot)
+	{
+		const TrimeshFace& face = faces[leafFaces[slot]];
+		vec3f a = vertex(face[0]);
+		vec3f ab = vertex(face[1]) - a;
+		vec3f ac = vertex(face[2]) - a;
+		for (int k = 0; k < 3; ++k)
+		{
+			packets.v0[k][slot] = float(a[k]);
+			packets.e1[k][slot] = float(ab[k]);
+			packets.e2[k][slot] = float(ac[k]);
+		}
+		// one-sided, the ray has to come from the front within NORMAL_EPSILON of
+		// grazing, degenerate faces are never hit
+		double len = ab.cross(ac).length();
+		if (len > 0.0)
+			packets.minDet[slot] = float(NORMAL_EPSILON * len);
+	}
+}
+
+#ifdef BVH_SIMD
+static inline __m128 dot(const __m128 a[3], const __m128 b[3])
+{
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]), _mm_mul_ps(a[1], b[1])), _mm_mul_ps(a[2], b[2]));
+}
+
+static inline void cross(const __m128 a[3], const __m128 b[3], __m128 c[3])
+{
+	c[0] = _mm_sub_ps(_mm_mul_ps(a[1], b[2]), _mm_mul_ps(a[2], b[1]));
+	c[1] = _mm_sub_ps(_mm_mul_ps(a[2], b[0]), _mm_mul_ps(a[0], b[2]));
+	c[2] = _mm_sub_ps(_mm_mul_ps(a[0], b[1]), _mm_mul_ps(a[1], b[0]));
+}
+
+// Moller-Trumbore on four faces at once
+void Trimesh::intersectFaces( int first, int end, const __m128 org[3], const __m128 dir[3],
+	double& closest, int& hit, vec3f& bary ) const
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 tMin = _mm_set1_ps(float(RAY_EPSILON));
+	for (int f = first; f < end; f += 4)
+	{
+		__m128 v0[3], e1[3], e2[3];
+		for (int k = 0; k < 3; ++k)
+		{
+			v0[k] = _mm_loadu_ps(&packets.v0[k][f]);
+			e1[k] = _mm_loadu_ps(&packets.e1[k][f]);
+			e2[k] = _mm_loadu_ps(&packets.e2[k][f]);
+		}
+		__m128 p[3], s[3], q[3];
+		cross(dir, e2, p);
+		__m128 det = dot(e1, p);
+		__m128 valid = _mm_cmpgt_ps(det, _mm_loadu_ps(&packets.minDet[f]));
+		if (_mm_movemask_ps(valid) == 0)
+			continue;
+		__m128 invDet = _mm_div_ps(one, det);
+		for (int k = 0; k < 3; ++k)
+			s[k] = _mm_sub_ps(org[k], v0[k]);
+		__m128 u = _mm_mul_ps(dot(s, p), invDet);
+		cross(s, e1, q);
+		__m128 v = _mm_mul_ps(dot(dir, q), invDet);
+		__m128 t = _mm_mul_ps(dot(e2, q), invDet);
+		valid = _mm_and_ps(valid, _mm_cmpge_ps(u, zero));
+		valid = _mm_and_ps(valid, _mm_cmpge_ps(v, zero));
+		valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), one));
+		valid = _mm_and_ps(valid, _mm_cmpge_ps(t, tMin));
+		int mask = _mm_movemask_ps(valid);
+		if (mask == 0)
+			continue;
+
+		float ts[4], us[4], vs[4];
+		_mm_storeu_ps(ts, t);
+		_mm_storeu_ps(us, u);
+		_mm_storeu_ps(vs, v);
+		for (int i = 0; i < 4 && f + i < end; ++i)
+		{
+			if ((mask & (1 << i)) && ts[i] < closest)
+			{
+				closest = ts[i];
+				hit = f + i;
+				bary = vec3f(1.0 - us[i] - vs[i], us[i], vs[i]);
+			}
+		}
+	}
+}
+#else
+// Moller-Trumbore, the same test as the SSE version one face at a time
+void Trimesh::intersectFaces( int first, int end, const float org[3], const float dir[3],
+	double& closest, int& hit, vec3f& bary ) const
+{
+	for (int f = first; f < end; ++f)
+	{
+		float e1[3], e2[3], s[3];
+		for (int k = 0; k < 3; ++k)
+		{
+			e1[k] = packets.e1[k][f];
+			e2[k] = packets.e2[k][f];
+			s[k] = org[k] - packets.v0[k][f];
+		}
+		float p[3] = {dir[1] * e2[2] - dir[2] * e2[1], dir[2] * e2[0] - dir[0] * e2[2], dir[0] * e2[1] - dir[1] * e2[0]};
+		float det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+		if (!(det > packets.minDet[f]))
+			continue;
+		float invDet = 1.0f / det;
+		float u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * invDet;
+		if (u < 0.0f || u > 1.0f)
+			continue;
+		float q[3] = {s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2], s[0] * e1[1] - s[1] * e1[0]};
+		float v = (dir[0] * q[0] + dir[1] * q[1] + dir[2] * q[2]) * invDet;
+		if (v < 0.0f || u + v > 1.0f)
+			continue;
+		float t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * invDet;
+		if (t >= float(RAY_EPSILON) && t < closest)
+		{
+			closest = t;
+			hit = f;
+			bary = vec3f(1.0 - u - v, u, v);
+		}
+	}
+}
+#endif
 
-    vec3f am = ap + t * v;
+BoundingBox Trimesh::faceBoundingBox( const TrimeshFace& face ) const
+{
+    BoundingBox localbounds;
+	vec3f a = vertex(face[0]), b = vertex(face[1]), c = vertex(face[2]);
+    localbounds.max = maximum( a, b );
+	localbounds.min = minimum( a, b );
     
-	bary[1] = (am.cross(ac))[k]/(ab.cross(ac))[k];
-    bary[2] = (ab.cross(am))[k]/(ab.cross(ac))[k];
-    bary[0] = 1-bary[1]-bary[2];
-    if( bary[0] < 0 || bary[1] < 0 || bary[1] > 1 || bary[2] < 0 || bary[2] > 1 )
-        return false;
+    localbounds.max = maximum( c, localbounds.max);
+	localbounds.min = minimum( c, localbounds.min);
+    return localbounds;
+}
 
-    // if we get this far, we have an intersection.  Fill in the info.
-    i.setT( t );
-    if(parent->normals.size())
-    {
-        // use interpolated normals
-        i.setN( (bary[0] * parent->normals[ids[0]]
-                 + bary[1] * parent->normals[ids[1]]
-                 + bary[2] * parent->normals[ids[2]]).normalize() );
-    } else {
-        i.setN( n );           // use face normal
-    }
-    i.obj = this;
+BoundingBox Trimesh::ComputeLocalBoundingBox()
+{
+	if (!bvh.nodes.empty())
+		return bvh.nodes[0].aabb;
+	// not built yet, the union of the faces is what the root will have
+	BoundingBox bounds;
+	for (size_t f = 0; f < faces.size(); ++f)
+	{
+		if (f == 0)
+			bounds = faceBoundingBox(faces[f]);
+		else
+			bounds.merge(faceBoundingBox(faces[f]));
+	}
+	return bounds;
+}
 
-    // linearly interpolate materials
-    if( parent->materials.size() )
-    {
-        Material *m = new Material();
-        for( int jj = 0; jj < 3; ++jj )
-            (*m) += bary[jj] * (*parent->materials[ ids[jj] ]);
-        i.setMaterial( m );
-    }
+bool Trimesh::intersectLocal( const Ray& r, Isect& i ) const
+{
+	double closest = 1.0e308;
+	int hit = -1;
+	vec3f hitBary;
+#ifdef BVH_SIMD
+	__m128 org[3], dir[3];
+	for (int k = 0; k < 3; ++k)
+	{
+		org[k] = _mm_set1_ps(float(r.getPosition()[k]));
+		dir[k] = _mm_set1_ps(float(r.getDirection()[k]));
+	}
+#else
+	float org[3], dir[3];
+	for (int k = 0; k < 3; ++k)
+	{
+		org[k] = float(r.getPosition()[k]);
+		dir[k] = float(r.getDirection()[k]);
+	}
+#endif
+	bvh.traverse(r, closest, [&](int first, int end)
+	{
+		intersectFaces(first, end, org, dir, closest, hit, hitBary);
+		return false;
+	});
+	if (hit < 0)
+		return false;
+
+	// the rest waits for computeLocalSurface, in case this hit is not kept
+	i.setT( closest );
+	i.prim = leafFaces[hit];
+	i.bary = hitBary;
+	i.obj = this;
+	return true;
+}
+
+// The rays go through the BVH of the faces as a packet in local space, where
+// t is scaled by the length of their direction
+uint64_t Trimesh::intersectHits( RayPacket& packet, uint64_t mask, Isect* isects ) const
+{
+	RayPacket local;
+	int rayOf[RayPacket::maxSize];
+	double length[RayPacket::maxSize];
+	for (int i = 0; i < packet.size; ++i)
+	{
+		if (!(mask >> i & 1))
+			continue;
+		double scale;
+		Ray r = transform->globalToLocalRay(packet.rays[i], scale);
+		length[local.size] = scale;
+		rayOf[local.size] = i;
+		local.add(r, packet.tMax[i] * scale);
+	}
+	if (local.size == 0)
+		return 0;
+	local.computeBounds();
+
+	int hit[RayPacket::maxSize];
+	vec3f hitBary[RayPacket::maxSize];
+#ifdef BVH_SIMD
+	__m128 org[RayPacket::maxSize][3], dir[RayPacket::maxSize][3];
+#else
+	float org[RayPacket::maxSize][3], dir[RayPacket::maxSize][3];
+#endif
+	for (int j = 0; j < local.size; ++j)
+	{
+		hit[j] = -1;
+		for (int k = 0; k < 3; ++k)
+		{
+#ifdef BVH_SIMD
+			org[j][k] = _mm_set1_ps(float(local.rays[j].getPosition()[k]));
+			dir[j][k] = _mm_set1_ps(float(local.rays[j].getDirection()[k]));
+#else
+			org[j][k] = float(local.rays[j].getPosition()[k]);
+			dir[j][k] = float(local.rays[j].getDirection()[k]);
+#endif
+		}
+	}
+	bvh.traversePacket(local, [&](int first, int end, uint64_t localMask)
+	{
+		for (int j = 0; j < local.size; ++j)
+		{
+			if (localMask >> j & 1)
+				intersectFaces(first, end, org[j], dir[j], local.tMax[j], hit[j], hitBary[j]);
+		}
+	});
+
+	uint64_t hits = 0;
+	for (int j = 0; j < local.size; ++j)
+	{
+		if (hit[j] < 0)
+			continue;
+		int i = rayOf[j];
+		Isect cur;
+		cur.setT(local.tMax[j] / length[j]);
+		cur.prim = leafFaces[hit[j]];
+		cur.bary = hitBary[j];
+		cur.obj = this;
+		cur.local = true;
+		packet.tMax[i] = cur.t;
+		isects[i] = cur;
+		hits |= 1ull << i;
+	}
+	return hits;
+}
+
+void Trimesh::computeLocalSurface( Isect& i ) const
+{
+	const TrimeshFace& face = faces[i.prim];
+	const vec3f& bary = i.bary;
+	if( hasNormals() )
+	{
+		// use interpolated normals
+		i.setN( (bary[0] * normal(face[0])
+				 + bary[1] * normal(face[1])
+				 + bary[2] * normal(face[2])).normalize() );
+	} else {
+		vec3f a = vertex(face[0]);
+		i.setN( (vertex(face[1]) - a).cross(vertex(face[2]) - a).normalize() );	// use face normal
+	}
+
+	if( materials.size() )
+		i.setVertexMaterials( materials[face[0]], materials[face[1]], materials[face[2]] );
 
 	if (enableTexCoords)
 	{
 		i.hasTexCoords = true;
-		double u = bary[0] * parent->texCoords[ids[0]].u + bary[1] * parent->texCoords[ids[1]].u + 
-            bary[2] * parent->texCoords[ids[2]].u;
-		double v = bary[0] * parent->texCoords[ids[0]].v + bary[1] * parent->texCoords[ids[1]].v + 
-            bary[2] * parent->texCoords[ids[2]].v;
+		TexCoords uv0 = texCoord(face[0]), uv1 = texCoord(face[1]), uv2 = texCoord(face[2]);
+		double u = bary[0] * uv0.u + bary[1] * uv1.u + bary[2] * uv2.u;
+		double v = bary[0] * uv0.v + bary[1] * uv1.v + bary[2] * uv2.v;
 		i.texCoords = {u, v};
-		i.tbn = TbnMatrix;
+		i.tbn = faceTbnMatrix(face);
 	}
-    
-    return true;
 }
 
-void TrimeshFace::generateTbnMatrix()
+mat3f Trimesh::faceTbnMatrix( const TrimeshFace& face ) const
 {
-	vec3f& v1 = parent->vertices[ids[0]];
-	vec3f& v2 = parent->vertices[ids[1]];
-	vec3f& v3 = parent->vertices[ids[2]];
+	vec3f v1 = vertex(face[0]);
+	vec3f v2 = vertex(face[1]);
+	vec3f v3 = vertex(face[2]);
+
+	TexCoords uv1 = texCoord(face[0]);
+	TexCoords uv2 = texCoord(face[1]);
+	TexCoords uv3 = texCoord(face[2]);
 
-	TexCoords& uv1 = parent->texCoords[ids[0]];
-	TexCoords& uv2 = parent->texCoords[ids[1]];
-	TexCoords& uv3 = parent->texCoords[ids[2]];
+	mat3f TbnMatrix;
 
 	double dU1 = uv2.u - uv1.u, dV1 = uv2.v - uv1.v;
 	double dU2 = uv3.u - uv2.u, dV2 = uv3.v - uv2.v;
@@ -203,19 +700,23 @@ void TrimeshFace::generateTbnMatrix()
 
 	TbnMatrix[1] = TbnMatrix[2].cross(TbnMatrix[0]).normalize();
 
-	TbnMatrix = TbnMatrix.transpose();      // previously TBN are row vectors, now converted to column vectors
+	return TbnMatrix.transpose();      // previously TBN are row vectors, now converted to column vectors
 }
 
-Ray TrimeshFace::sample(vec3f& emit, double& pdf) const
+// Pick a face with probability proportional to its area, then a point on it
+Ray Trimesh::sample(vec3f& emit, double& pdf) const
 {
-	double x = sqrt(getRandomReal()), y = getRandomReal();
-	vec3f& v1 = parent->vertices[ids[0]];
-	vec3f& v2 = parent->vertices[ids[1]];
-	vec3f& v3 = parent->vertices[ids[2]];
+	int f = upper_bound(areaCdf.begin(), areaCdf.end(), getRandomReal() * area) - areaCdf.begin();
+	if (f >= int(faces.size()))
+		f = int(faces.size()) - 1;
+	vec3f v1 = vertex(faces[f][0]);
+	vec3f v2 = vertex(faces[f][1]);
+	vec3f v3 = vertex(faces[f][2]);
 
+	double x = sqrt(getRandomReal()), y = getRandomReal();
 	vec3f pos = v1 * (1.0 - x) + v2 * (x * (1.0 - y)) + v3 * (x * y);
 	pos = transform->xform * pos;
-	vec3f normal = transform->normi * faceNormal;
+	vec3f normal = transform->normi * (v2 - v1).cross(v3 - v1);
 	emit = emission;
 	pdf = 1.0 / area;
     return Ray(pos, normal.normalize());
@@ -227,22 +728,22 @@ Trimesh::generateNormals()
 // vertex normals by averaging the normals of the neighboring faces.
 {
     int cnt = vertices.size();
-    normals.resize( cnt );
+    normals.assign( cnt, vec3f() );
     int *numFaces = new int[ cnt ]; // the number of faces assoc. with each vertex
     memset( numFaces, 0, sizeof(int)*cnt );
     
     for( Faces::iterator fi = faces.begin(); fi != faces.end(); ++fi )
     {
-        vec3f a = vertices[(**fi)[0]];
-        vec3f b = vertices[(**fi)[1]];
-        vec3f c = vertices[(**fi)[2]];
+        vec3f a = vertices[(*fi)[0]];
+        vec3f b = vertices[(*fi)[1]];
+        vec3f c = vertices[(*fi)[2]];
         
         vec3f faceNormal = ((b-a).cross(c-a)).normalize();
         
         for( int i = 0; i < 3; ++i )
         {
-            normals[(**fi)[i]] += faceNormal;
-            ++numFaces[(**fi)[i]];
+            normals[(*fi)[i]] += faceNormal;
+            ++numFaces[(*fi)[i]];
         }
     }
 
@@ -254,13 +755,3 @@ Trimesh::generateNormals()
 
     delete [] numFaces;
 }
-
-void Trimesh::generateTbnMatrices()
-{
-	if (!enableTexCoords)
-        return;
-
-	for (auto& face : faces)
-		face->generateTbnMatrix();
-}
-
@@ -7,20 +7,67 @@
 #include "../scene/Ray.h"
 #include "../scene/material.h"
 #include "../scene/scene.h"
-class TrimeshFace;
 
+// A triangle of a Trimesh, just the indices of its three vertices
+class TrimeshFace
+{
+public:
+    TrimeshFace( int a, int b, int c )
+    {
+        ids[0] = a;
+        ids[1] = b;
+        ids[2] = c;
+    }
+
+    int operator[]( int i ) const
+    {
+        return ids[i];
+    }
+
+    int ids[3];
+};
+
+// The faces are not added to the scene, the mesh owns a bottom-level BVH
+// over them in its local space and is a single bounded object in the scene.
 class Trimesh : public MaterialSceneObject
 {
-    friend class TrimeshFace;
     typedef vector<vec3f> Normals;
     typedef vector<vec3f> Vertices;
-    typedef vector<TrimeshFace*> Faces;
+    typedef vector<TrimeshFace> Faces;
     typedef vector<Material*> Materials;
     Vertices vertices;
     Faces faces;
     Normals normals;
     Materials materials;
 	std::vector<TexCoords> texCoords;
+	std::vector<double> areaCdf;		// running sum of the face areas, for sampling
+	double area{0.0};
+	BVH bvh;
+	std::vector<int> leafFaces;		// face of every leaf slot, spatial splits put some faces in several leaves
+	// The leaf slots with float vertex and edge data per coordinate, all the
+	// intersection test needs in the order traversal reads it.  With BVH_SIMD
+	// four of them are tested at once, padded by three faces no ray hits.
+	struct FacePackets
+	{
+		std::vector<float> v0[3], e1[3], e2[3];
+		std::vector<float> minDet;		// smallest determinant of a front facing hit
+	} packets;
+public:
+	// How the vertex attributes are kept once the BVH is built.  The compact
+	// formats store octahedral normals in 32 bits and half float texture
+	// coordinates, with float positions or 16 bit ones over the bounds.
+	enum class VertexFormat { Double, Float, Quantized };
+private:
+	VertexFormat vertexFormat{VertexFormat::Double};
+	bool compacted{false};
+	struct CompactVertices
+	{
+		std::vector<float> positions;		// Float, 3 per vertex
+		std::vector<uint16_t> quantized;	// Quantized, 3 per vertex
+		vec3f origin, step;					// of the quantized positions
+		std::vector<uint32_t> normals;
+		std::vector<uint16_t> texCoords;	// 2 per vertex
+	} compact;
 public:
     Trimesh( Scene *scene, Material *mat, TransformNode *transform )
         : MaterialSceneObject(scene, mat)
@@ -29,72 +76,66 @@ public:
     }
 
     ~Trimesh();
-    
+
     // must add vertices, normals, and materials IN ORDER
+	void reserve( int numVertices, int numFaces, bool withNormals, bool withTexCoords );
     void addVertex( const vec3f & );
+	void setVertex( int i, const vec3f & );		// call refitBVH once all are moved
     void addMaterial( Material *m );
     void addNormal( const vec3f & );
 	void addTexCoords(double u, double v);
 	void addTexCoords(const TexCoords& coords);
 	void setEnableTexCoords(bool value) override { enableTexCoords = value; }
 	void setEmission(const vec3f& emit);
+	void setVertexFormat(VertexFormat format) { vertexFormat = format; }
 
     bool addFace( int a, int b, int c );
 
     char *doubleCheck();
-    
-    void generateNormals();
-	void generateTbnMatrices();
-};
 
-class TrimeshFace : public MaterialSceneObject
-{
-    Trimesh *parent;
-    int ids[3];
-	mat3f TbnMatrix;
-	vec3f faceNormal;
-	double area;
-public:
-    TrimeshFace( Scene *scene, Material *mat, Trimesh *parent, int a, int b, int c)
-        : MaterialSceneObject( scene, mat )
-    {
-        this->parent = parent;
-        ids[0] = a;
-        ids[1] = b;
-        ids[2] = c;
-
-    		vec3f& v1 = parent->vertices[a];
-		vec3f& v2 = parent->vertices[b];
-		vec3f& v3 = parent->vertices[c];
-
-    		faceNormal = (v2 - v1).cross(v3 - v1);
-    		area = faceNormal.length() * 0.5;
-    		faceNormal = faceNormal.normalize();
-    }
+    void generateNormals();
 
-    int operator[]( int i ) const
-    {
-        return ids[i];
-    }
+	// Builds the BVH over the faces, which reorders them.  Called once the
+	// scene is read.
+	void buildBVH(BVHCache* cache) override;
+	void setBVHSplitMethod(BVH::SplitMethod method) override;
+	void setBVHThreads(int numThreads) override { bvh.numThreads = numThreads; }
+	// Updates the BVH and the bounding box after vertices moved
+	void refitBVH();
 
     virtual bool intersectLocal( const Ray& r, Isect& i ) const;
+	uint64_t intersectHits( RayPacket& packet, uint64_t mask, Isect* isects ) const override;
+	void computeLocalSurface( Isect& i ) const override;
 
-    virtual bool hasBoundingBoxCapability() const { return true; }
-      
-    virtual BoundingBox ComputeLocalBoundingBox()
-    {
-        BoundingBox localbounds;
-        localbounds.max = maximum( parent->vertices[ids[0]], parent->vertices[ids[1]]);
-		localbounds.min = minimum( parent->vertices[ids[0]], parent->vertices[ids[1]]);
-        
-        localbounds.max = maximum( parent->vertices[ids[2]], localbounds.max);
-		localbounds.min = minimum( parent->vertices[ids[2]], localbounds.min);
-        return localbounds;
-    }
+    virtual bool hasBoundingBoxCapability() const { return !faces.empty(); }
+    virtual BoundingBox ComputeLocalBoundingBox();
 
-	void generateTbnMatrix();
 	Ray sample(vec3f& emit, double& pdf) const override;
 	double getArea() const override { return area; }
+
+protected:
+	// The attributes of vertex i in any format
+	vec3f vertex( int i ) const;
+	vec3f normal( int i ) const;
+	TexCoords texCoord( int i ) const;
+	bool hasNormals() const { return !normals.empty() || !compact.normals.empty(); }
+	void compactVertices();
+	void expandVertices();
+
+	void packFaces();
+	// Test the leaf slots [first, end), update closest, hit and bary if one is closer
+#ifdef BVH_SIMD
+	void intersectFaces( int first, int end, const __m128 org[3], const __m128 dir[3],
+		double& closest, int& hit, vec3f& bary ) const;
+#else
+	void intersectFaces( int first, int end, const float org[3], const float dir[3],
+		double& closest, int& hit, vec3f& bary ) const;
+#endif
+	BoundingBox faceBoundingBox( const TrimeshFace& face ) const;
+	vector<BoundingBox> faceBoundingBoxes() const;
+	void clipFace( int f, const BoundingBox& box, int axis, double pos, BoundingBox& left, BoundingBox& right ) const;
+	void updateFaces();		// reorder the faces as the BVH did and update what depends on them
+	mat3f faceTbnMatrix( const TrimeshFace& face ) const;
 };
 
 
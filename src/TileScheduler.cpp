@@ -0,0 +1,156 @@
+#include <algorithm>
+#include <cstdint>
+
+#include "TileScheduler.h"
+
+TileScheduler::TileScheduler(int numThreads)
+{
+	if (numThreads <= 0)
+		numThreads = std::max(int(std::thread::hardware_concurrency()), 1);
+	for (int i = 0; i < numThreads; ++i)
+		queues.emplace_back(new Queue);
+	for (int i = 0; i < numThreads; ++i)
+		threads.emplace_back(&TileScheduler::work, this, i);
+}
+
+TileScheduler::~TileScheduler()
+{
+	cancel();
+	wait();
+	{
+		std::lock_guard<std::mutex> guard(jobLock);
+		stopping = true;
+	}
+	jobStart.notify_all();
+	for (auto& thread : threads)
+		thread.join();
+}
+
+// Bits of x spread out to every other bit
+static uint32_t spreadBits(uint32_t x)
+{
+	x &= 0xffff;
+	x = (x | (x << 8)) & 0x00ff00ff;
+	x = (x | (x << 4)) & 0x0f0f0f0f;
+	x = (x | (x << 2)) & 0x33333333;
+	x = (x | (x << 1)) & 0x55555555;
+	return x;
+}
+
+void TileScheduler::start(int x0, int y0, int x1, int y1, int tileWidth, int tileHeight, const TileFunc& func)
+{
+	wait();
+
+	int tilesX = (x1 - x0 + tileWidth - 1) / tileWidth;
+	int tilesY = (y1 - y0 + tileHeight - 1) / tileHeight;
+	std::vector<std::pair<uint32_t, Tile>> tiles;
+	tiles.reserve(std::max(tilesX * tilesY, 0));
+	for (int ty = 0; ty < tilesY; ++ty)
+	{
+		for (int tx = 0; tx < tilesX; ++tx)
+		{
+			Tile tile;
+			tile.x0 = x0 + tx * tileWidth;
+			tile.y0 = y0 + ty * tileHeight;
+			tile.x1 = std::min(tile.x0 + tileWidth, x1);
+			tile.y1 = std::min(tile.y0 + tileHeight, y1);
+			tiles.push_back({spreadBits(tx) | spreadBits(ty) << 1, tile});
+		}
+	}
+	std::stable_sort(tiles.begin(), tiles.end(),
+		[](const std::pair<uint32_t, Tile>& a, const std::pair<uint32_t, Tile>& b) { return a.first < b.first; });
+	if (tiles.empty())
+		return;
+
+	this->func = func;
+	cancelled = false;
+	numTiles = int(tiles.size());
+	remaining = numTiles;
+	int numThreads = getNumThreads();
+	for (int i = 0; i < numThreads; ++i)
+	{
+		std::lock_guard<std::mutex> guard(queues[i]->lock);
+		for (int j = int(tiles.size()) * i / numThreads; j < int(tiles.size()) * (i + 1) / numThreads; ++j)
+			queues[i]->tiles.push_back(tiles[j].second);
+	}
+	{
+		std::lock_guard<std::mutex> guard(jobLock);
+		++generation;
+	}
+	jobStart.notify_all();
+}
+
+void TileScheduler::wait()
+{
+	std::unique_lock<std::mutex> lock(jobLock);
+	jobDone.wait(lock, [this] { return remaining == 0; });
+}
+
+void TileScheduler::parallelFor(int count, int grain, const std::function<void(int begin, int end)>& body)
+{
+	run(0, 0, count, 1, std::max(grain, 1), 1, [&](int x0, int, int x1, int) { body(x0, x1); });
+}
+
+double TileScheduler::progress() const
+{
+	return numTiles > 0 ? 1.0 - double(remaining) / numTiles : 1.0;
+}
+
+void TileScheduler::cancel()
+{
+	cancelled = true;
+}
+
+bool TileScheduler::takeTile(int self, Tile& tile)
+{
+	{
+		Queue& own = *queues[self];
+		std::lock_guard<std::mutex> guard(own.lock);
+		if (!own.tiles.empty())
+		{
+			tile = own.tiles.front();
+			own.tiles.pop_front();
+			return true;
+		}
+	}
+	int numThreads = getNumThreads();
+	for (int i = 1; i < numThreads; ++i)
+	{
+		Queue& victim = *queues[(self + i) % numThreads];
+		std::lock_guard<std::mutex> guard(victim.lock);
+		if (!victim.tiles.empty())
+		{
+			tile = victim.tiles.back();
+			victim.tiles.pop_back();
+			return true;
+		}
+	}
+	return false;
+}
+
+void TileScheduler::work(int self)
+{
+	int seen = 0;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(jobLock);
+			jobStart.wait(lock, [&] { return stopping || generation != seen; });
+			if (stopping)
+				return;
+			seen = generation;
+		}
+
+		Tile tile;
+		while (takeTile(self, tile))
+		{
+			if (!cancelled)
+				func(tile.x0, tile.y0, tile.x1, tile.y1);
+			if (--remaining == 0)
+			{
+				std::lock_guard<std::mutex> guard(jobLock);
+				jobDone.notify_all();
+			}
+		}
+	}
+}
@@ -0,0 +1,73 @@
+#ifndef __TILESCHEDULER_H__
+#define __TILESCHEDULER_H__
+
+// Persistent pool of render threads.  A job is a rectangle cut into tiles,
+// which are put in Morton order and dealt out to the threads in contiguous
+// runs, so neighbouring tiles tend to be rendered by the same thread.  A
+// thread takes tiles from the front of its own run and, once that is empty,
+// steals from the back of the others, so uneven tiles don't leave threads
+// idle until the end of the job.
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class TileScheduler
+{
+public:
+	typedef std::function<void(int x0, int y0, int x1, int y1)> TileFunc;
+
+	explicit TileScheduler(int numThreads);		// one per core if numThreads <= 0
+	~TileScheduler();
+
+	int getNumThreads() const { return int(threads.size()); }
+
+	// Calls func(x0, y0, x1, y1) on the pool for every tile of at most
+	// tileWidth x tileHeight covering [x0, x1) x [y0, y1), and returns at once
+	void start(int x0, int y0, int x1, int y1, int tileWidth, int tileHeight, const TileFunc& func);
+	void wait();		// until all tiles of the job are done or dropped
+	void run(int x0, int y0, int x1, int y1, int tileWidth, int tileHeight, const TileFunc& func)
+	{
+		start(x0, y0, x1, y1, tileWidth, tileHeight, func);
+		wait();
+	}
+	// body(begin, end) over [0, count) in chunks of grain
+	void parallelFor(int count, int grain, const std::function<void(int begin, int end)>& body);
+
+	bool isDone() const { return remaining == 0; }
+	double progress() const;		// fraction of the tiles of the job done
+	void cancel();		// drop the tiles not started yet
+
+protected:
+	struct Tile
+	{
+		int x0, y0, x1, y1;
+	};
+	struct Queue
+	{
+		std::mutex lock;
+		std::deque<Tile> tiles;
+	};
+
+	void work(int self);
+	bool takeTile(int self, Tile& tile);
+
+	std::vector<std::thread> threads;
+	std::vector<std::unique_ptr<Queue>> queues;		// one per thread
+	TileFunc func;
+
+	std::mutex jobLock;
+	std::condition_variable jobStart, jobDone;
+	int generation{0};		// of the job, bumped to start the next one
+	bool stopping{false};
+	std::atomic<int> remaining{0};		// tiles not done
+	std::atomic<bool> cancelled{false};
+	int numTiles{0};
+};
+
+#endif // __TILESCHEDULER_H__
@@ -0,0 +1,216 @@
+#include "Wavefront.h"
+#include "scene/material.h"
+#include "SceneObjects/Box.h"
+
+void Wavefront::addPath( const Ray& r, int pixel, const Random& rng )
+{
+	Path path;
+	path.ray = r;
+	path.beta = vec3f(1.0, 1.0, 1.0);
+	path.pixel = pixel;
+	path.alive = true;
+	path.rng = rng;
+	paths.push_back(path);
+}
+
+void Wavefront::trace( Scene* scene, TileScheduler& scheduler, std::vector<vec3f>& colors, double weight )
+{
+	this->scheduler = &scheduler;
+
+	// the camera rays were added a block of pixels after the other, packets
+	// of them go through the BVHs together if they share a time
+	Camera* camera = scene->getCamera();
+	bool coherent = camera->getShutterOpen() == camera->getShutterClose();
+
+	for (int bounce = 0; bounce < maxDepth && !paths.empty(); ++bounce)
+	{
+		intersect(scene, coherent && bounce == 0);
+		sortHits();
+		shade(scene);
+		traceShadowRays(scene);
+		compact(colors, weight);
+	}
+	for (auto& path : paths)
+		colors[path.pixel] += path.radiance.clamp() * weight;
+	paths.clear();
+}
+
+void Wavefront::intersect( Scene* scene, bool coherent )
+{
+	int count = size();
+	if (int(isects.size()) < count)
+		isects.resize(count);
+	hits.resize(count);
+
+	if (coherent)
+	{
+		scheduler->parallelFor(count, RayPacket::maxSize, [&](int first, int end)
+		{
+			RayPacket packet;
+			for (int k = first; k < end; ++k)
+				packet.add(paths[k].ray);
+			packet.computeBounds();
+			uint64_t mask = scene->bvhIntersect(packet, &isects[first]);
+			for (int k = first; k < end; ++k)
+				hits[k] = mask >> (k - first) & 1;
+		});
+		return;
+	}
+
+	scheduler->parallelFor(count, grain, [&](int begin, int end)
+	{
+		for (int k = begin; k < end; ++k)
+			hits[k] = scene->bvhIntersect(paths[k].ray, isects[k]);
+	});
+}
+
+// The slots that hit, grouped by object, which sets both the intersection
+// code that filled them in and the material to shade.  A counting sort: a
+// scene has few objects next to the paths of a wave, and within an object
+// the slots stay in order.
+void Wavefront::sortHits()
+{
+	objectKeys.clear();
+	keys.resize(size());
+	starts.assign(1, 0);
+	for (int k = 0; k < size(); ++k)
+	{
+		if (!hits[k])
+			continue;
+		auto found = objectKeys.emplace(isects[k].obj, int(objectKeys.size()));
+		keys[k] = found.first->second;
+		if (found.second)
+			starts.push_back(0);
+		++starts[keys[k] + 1];
+	}
+	for (size_t key = 1; key < starts.size(); ++key)
+		starts[key] += starts[key - 1];
+
+	order.resize(starts.back());
+	for (int k = 0; k < size(); ++k)
+	{
+		if (hits[k])
+			order[starts[keys[k]]++] = k;
+	}
+}
+
+// A bounce of tracePath for every path, on the hits in the sorted order
+void Wavefront::shade( Scene* scene )
+{
+	shadowRays.resize(size());
+	for (int k = 0; k < size(); ++k)
+	{
+		shadowRays[k].valid = false;
+		if (hits[k])
+			continue;
+
+		// the ray leaves the scene
+		Path& path = paths[k];
+		if (scene->useSkybox)
+		{
+			Isect i;
+			scene->skybox->intersect(path.ray, i);
+			path.radiance += prod(path.beta, scene->skybox->getColor(path.ray, i) / 255.0);
+		}
+		path.alive = false;
+	}
+
+	scheduler->parallelFor(int(order.size()), grain, [&](int begin, int end)
+	{
+		for (int n = begin; n < end; ++n)
+			shadeHit(scene, order[n]);
+	});
+}
+
+// A bounce of tracePath for the path in slot k, which hit something
+void Wavefront::shadeHit( Scene* scene, int k )
+{
+	Path& path = paths[k];
+	RandomScope scope(path.rng);
+	const Isect& isect = isects[k];
+	if (isect.obj->hasEmission)
+	{
+		path.radiance += prod(isect.obj->getEmission(), path.beta);
+		path.alive = false;
+		return;
+	}
+
+	const Material& material = isect.getMaterial();
+	vec3f pos = path.ray.at(isect.t) + isect.N * DISPLACEMENT_EPSILON;
+	if (!material.isTransmissive)
+	{
+		vec3f emission;
+		double lightPdf;
+		Ray directLight = scene->uniformSampleOneLight(emission, lightPdf);
+
+		vec3f lightDir = (directLight.getPosition() - pos).normalize();
+		double distance = (directLight.getPosition() - pos).length();
+		// From sampling solid angle to sampling light area
+		double coeff = directLight.getDirection().dot(-lightDir) / (distance * distance * lightPdf);
+		coeff *= isect.N.dot(lightDir);
+		if (coeff > 0.0)
+		{
+			vec3f bxdf = material.bxdf(lightDir, -path.ray.getDirection(), isect.N);
+			ShadowRay& shadow = shadowRays[k];
+			shadow.ray = Ray(pos, lightDir);
+			shadow.tMax = distance - RAY_EPSILON;
+			shadow.contribution = prod(path.beta, prod(bxdf, emission * coeff));
+			shadow.valid = true;
+		}
+	}
+
+	double rr = getRandomReal(); // Russian roulette
+	if (rr > rrThresh)
+	{
+		path.alive = false;
+		return;
+	}
+
+	double bxdfPdf;
+	vec3f wo = -path.ray.getDirection();
+	vec3f wi;
+	vec3f bxdf = material.sampleF(wo, wi, isect.N, bxdfPdf);	// sample new direction and get the BxDF
+	if (bxdf.iszero())
+	{
+		path.alive = false;
+		return;
+	}
+	wi = wi.normalize();
+
+	double coeff = _abs(isect.N.dot(wi)) / (bxdfPdf * rrThresh);
+	path.beta = prod(bxdf, path.beta) * coeff;
+	path.ray = Ray(pos, wi);
+	if (path.beta.iszero())
+		path.alive = false;
+}
+
+void Wavefront::traceShadowRays( Scene* scene )
+{
+	scheduler->parallelFor(size(), grain, [&](int begin, int end)
+	{
+		for (int k = begin; k < end; ++k)
+		{
+			const ShadowRay& shadow = shadowRays[k];
+			if (shadow.valid && !scene->occluded(shadow.ray, shadow.tMax))
+				paths[k].radiance += shadow.contribution;
+		}
+	});
+}
+
+// Ended paths go to their pixels, the rest move up in the queue in order
+void Wavefront::compact( std::vector<vec3f>& colors, double weight )
+{
+	int alive = 0;
+	for (int k = 0; k < size(); ++k)
+	{
+		if (!paths[k].alive)
+			colors[paths[k].pixel] += paths[k].radiance.clamp() * weight;
+		else
+		{
+			if (alive != k)
+				paths[alive] = paths[k];
+			++alive;
+		}
+	}
+	paths.resize(alive);
+}
@@ -0,0 +1,74 @@
+#ifndef __WAVEFRONT_H__
+#define __WAVEFRONT_H__
+
+// Breadth-first path tracing.  Rather than following one path through all of
+// its bounces as RayTracer::tracePath does, a whole queue of paths advances a
+// bounce at a time: all their rays are intersected, the hits sorted by object
+// so that each material is shaded in one run, then the shadow rays this
+// emits are traced and the paths still going form the next queue.
+// On one core and a scene as small as the Cornell box this is no faster
+// than tracePath: the queues cost about what the camera packets save.
+
+#include <unordered_map>
+#include <vector>
+
+#include "scene/scene.h"
+#include "scene/Ray.h"
+#include "TileScheduler.h"
+
+class Wavefront
+{
+public:
+	// Starts a path along the camera ray r, for pixel, sampled with rng
+	void addPath( const Ray& r, int pixel, const Random& rng );
+	int size() const { return int(paths.size()); }
+
+	// Traces the paths added until all of them end, adding the radiance of
+	// each, clamped and times weight, to colors[pixel]
+	void trace( Scene* scene, TileScheduler& scheduler, std::vector<vec3f>& colors, double weight );
+
+	static const int waveSize{1 << 16};		// paths in flight, the caller traces once this many are added
+	int maxDepth{32};
+	double rrThresh{0.7};	// russian roulette threshold
+
+protected:
+	void intersect( Scene* scene, bool coherent );
+	void sortHits();
+	void shade( Scene* scene );
+	void shadeHit( Scene* scene, int k );
+	void traceShadowRays( Scene* scene );
+	void compact( std::vector<vec3f>& colors, double weight );
+
+	struct Path
+	{
+		Ray ray;
+		vec3f beta;
+		vec3f radiance;
+		int pixel;
+		bool alive;
+		Random rng;		// so the path is the same whichever thread shades it
+	};
+	// The light sampled at a hit, added to the radiance of its path if nothing is in the way
+	struct ShadowRay
+	{
+		Ray ray;
+		double tMax;
+		vec3f contribution;
+		bool valid;
+	};
+
+	// All indexed by the slot of the path in the queue
+	std::vector<Path> paths;
+	std::vector<Isect> isects;
+	std::vector<char> hits;
+	std::vector<ShadowRay> shadowRays;
+	std::vector<int> order;		// the slots that hit, grouped by object
+	std::vector<int> keys;		// the object of the hit in each slot, for sortHits
+	std::vector<int> starts;	// of the slots of each object in order
+	std::unordered_map<const SceneObject*, int> objectKeys;
+
+	TileScheduler* scheduler{nullptr};		// of the trace running
+	static const int grain{64};		// paths per task of a stage
+};
+
+#endif // __WAVEFRONT_H__
@@ -0,0 +1,805 @@
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+#include "meshfile.h"
+
+// A file mapped read only while the object lives
+class MappedFile
+{
+public:
+	explicit MappedFile(const string& path);
+	~MappedFile();
+
+	const char* begin() const { return data; }
+	const char* end() const { return data + size; }
+	bool isOpen() const { return data != nullptr; }
+
+private:
+	const char* data{nullptr};
+	size_t size{0};
+	void* handle{nullptr};		// of the mapping on Windows
+};
+
+MappedFile::MappedFile(const string& path)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return;
+	LARGE_INTEGER fileSize;
+	if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+	{
+		size = size_t(fileSize.QuadPart);
+		handle = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (handle != NULL)
+			data = static_cast<const char*>(MapViewOfFile(handle, FILE_MAP_READ, 0, 0, 0));
+	}
+	CloseHandle(file);
+#else
+	int file = open(path.c_str(), O_RDONLY);
+	if (file < 0)
+		return;
+	struct stat status;
+	if (fstat(file, &status) == 0 && status.st_size > 0)
+	{
+		size = size_t(status.st_size);
+		void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+		if (mapped != MAP_FAILED)
+		{
+			data = static_cast<const char*>(mapped);
+			madvise(mapped, size, MADV_SEQUENTIAL);
+		}
+	}
+	close(file);
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#ifdef _WIN32
+	if (data != nullptr)
+		UnmapViewOfFile(data);
+	if (handle != nullptr)
+		CloseHandle(handle);
+#else
+	if (data != nullptr)
+		munmap(const_cast<char*>(data), size);
+#endif
+}
+
+// Text is parsed straight out of the mapping, which isn't null terminated
+
+static bool isBlank(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static bool isDigit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static void skipBlanks(const char*& p, const char* end)
+{
+	while (p < end && isBlank(*p))
+		++p;
+}
+
+static bool parseInt(const char*& p, const char* end, long long& value)
+{
+	const char* s = p;
+	bool negative = false;
+	if (s < end && (*s == '-' || *s == '+'))
+		negative = *s++ == '-';
+	if (s == end || !isDigit(*s))
+		return false;
+	value = 0;
+	for (; s < end && isDigit(*s); ++s)
+		value = value * 10 + (*s - '0');
+	if (negative)
+		value = -value;
+	p = s;
+	return true;
+}
+
+// The first 19 significant digits scaled by a power of ten, which is exact up
+// to 1e22 and correctly rounded for the usual 7 to 9 digits of a mesh file
+static bool parseReal(const char*& p, const char* end, double& value)
+{
+	static const double powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+		1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+	const char* s = p;
+	bool negative = false;
+	if (s < end && (*s == '-' || *s == '+'))
+		negative = *s++ == '-';
+	uint64_t mantissa = 0;
+	int digits = 0, exponent = 0;
+	bool any = false;
+	for (; s < end && isDigit(*s); ++s)
+	{
+		any = true;
+		if (digits < 19)
+		{
+			mantissa = mantissa * 10 + (*s - '0');
+			digits += mantissa != 0;
+		}
+		else
+			++exponent;
+	}
+	if (s < end && *s == '.')
+	{
+		for (++s; s < end && isDigit(*s); ++s)
+		{
+			any = true;
+			if (digits < 19)
+			{
+				mantissa = mantissa * 10 + (*s - '0');
+				digits += mantissa != 0;
+				--exponent;
+			}
+		}
+	}
+	if (!any)
+		return false;
+	if (s < end && (*s == 'e' || *s == 'E'))
+	{
+		const char* e = s + 1;
+		long long power;
+		if (parseInt(e, end, power))
+		{
+			exponent += int(std::max(std::min(power, 1000ll), -1000ll));
+			s = e;
+		}
+	}
+
+	value = double(mantissa);
+	if (mantissa != 0)
+	{
+		if (exponent >= 0)
+			value *= exponent <= 22 ? powers[exponent] : pow(10.0, exponent);
+		else
+			value /= exponent >= -22 ? powers[-exponent] : pow(10.0, -exponent);
+	}
+	if (negative)
+		value = -value;
+	p = s;
+	return true;
+}
+
+// Adds the fan of a polygon, false if it refers to a vertex the mesh doesn't have
+static bool addPolygon(Trimesh* mesh, const int* ids, int count)
+{
+	for (int k = 2; k < count; ++k)
+	{
+		if (ids[0] < 0 || ids[k - 1] < 0 || ids[k] < 0 || !mesh->addFace(ids[0], ids[k - 1], ids[k]))
+			return false;
+	}
+	return true;
+}
+
+//
+// PLY
+//
+
+enum PlyType
+{
+	PLY_NONE, PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64
+};
+
+enum PlyFormat
+{
+	PLY_ASCII, PLY_LITTLE_ENDIAN, PLY_BIG_ENDIAN
+};
+
+struct PlyProperty
+{
+	string name;
+	PlyType type;
+	PlyType countType;		// PLY_NONE unless it is a list
+};
+
+struct PlyElement
+{
+	string name;
+	long long count;
+	vector<PlyProperty> properties;
+
+	int find(const char* const* names) const;
+	int stride() const;		// bytes of one in a binary file, 0 with lists
+	int minSize(PlyFormat format) const;	// bytes of one at least, with empty lists
+};
+
+static PlyType plyType(const string& name)
+{
+	static const struct { const char* name; PlyType type; } types[] = {
+		{"char", PLY_INT8}, {"int8", PLY_INT8}, {"uchar", PLY_UINT8}, {"uint8", PLY_UINT8},
+		{"short", PLY_INT16}, {"int16", PLY_INT16}, {"ushort", PLY_UINT16}, {"uint16", PLY_UINT16},
+		{"int", PLY_INT32}, {"int32", PLY_INT32}, {"uint", PLY_UINT32}, {"uint32", PLY_UINT32},
+		{"float", PLY_FLOAT32}, {"float32", PLY_FLOAT32}, {"double", PLY_FLOAT64}, {"float64", PLY_FLOAT64}
+	};
+	for (const auto& entry : types)
+	{
+		if (name == entry.name)
+			return entry.type;
+	}
+	return PLY_NONE;
+}
+
+static int plySize(PlyType type)
+{
+	static const int sizes[] = {0, 1, 1, 2, 2, 4, 4, 4, 8};
+	return sizes[type];
+}
+
+// Index of the first property with one of the names, -1 if there is none
+int PlyElement::find(const char* const* names) const
+{
+	for (; *names != nullptr; ++names)
+	{
+		for (int k = 0; k < int(properties.size()); ++k)
+		{
+			if (properties[k].name == *names)
+				return k;
+		}
+	}
+	return -1;
+}
+
+int PlyElement::stride() const
+{
+	int bytes = 0;
+	for (const auto& property : properties)
+	{
+		if (property.countType != PLY_NONE)
+			return 0;
+		bytes += plySize(property.type);
+	}
+	return bytes;
+}
+
+// A value takes a digit and a blank in an ASCII file
+int PlyElement::minSize(PlyFormat format) const
+{
+	int bytes = 0;
+	for (const auto& property : properties)
+	{
+		PlyType type = property.countType != PLY_NONE ? property.countType : property.type;
+		bytes += format == PLY_ASCII ? 2 : plySize(type);
+	}
+	return bytes;
+}
+
+// The values of the elements one after the other
+class PlyStream
+{
+public:
+	PlyStream(const char* p, const char* end, PlyFormat format)
+		: p(p), end(end), format(format)
+	{
+		const uint16_t one = 1;
+		bool little = *reinterpret_cast<const unsigned char*>(&one) == 1;
+		swap = format == (little ? PLY_BIG_ENDIAN : PLY_LITTLE_ENDIAN);
+	}
+
+	bool read(PlyType type, double& value)
+	{
+		if (format == PLY_ASCII)
+		{
+			while (p < end && (isBlank(*p) || *p == '\n'))
+				++p;
+			return parseReal(p, end, value);
+		}
+
+		int size = plySize(type);
+		if (end - p < size)
+			return false;
+		unsigned char bytes[8];
+		memcpy(bytes, p, size);
+		p += size;
+		if (swap)
+			std::reverse(bytes, bytes + size);
+		switch (type)
+		{
+		case PLY_INT8:		{ int8_t v; memcpy(&v, bytes, size); value = v; break; }
+		case PLY_UINT8:		{ uint8_t v; memcpy(&v, bytes, size); value = v; break; }
+		case PLY_INT16:		{ int16_t v; memcpy(&v, bytes, size); value = v; break; }
+		case PLY_UINT16:	{ uint16_t v; memcpy(&v, bytes, size); value = v; break; }
+		case PLY_INT32:		{ int32_t v; memcpy(&v, bytes, size); value = v; break; }
+		case PLY_UINT32:	{ uint32_t v; memcpy(&v, bytes, size); value = v; break; }
+		case PLY_FLOAT32:	{ float v; memcpy(&v, bytes, size); value = v; break; }
+		default:			{ double v; memcpy(&v, bytes, size); value = v; break; }
+		}
+		return true;
+	}
+
+	// Reads an element into values, the lengths of its lists included.
+	// The items of the list at index list go to items, the other ones are skipped.
+	bool read(const PlyElement& element, vector<double>& values, int list, vector<int>& items)
+	{
+		for (int k = 0; k < int(element.properties.size()); ++k)
+		{
+			const PlyProperty& property = element.properties[k];
+			if (property.countType == PLY_NONE)
+			{
+				if (!read(property.type, values[k]))
+					return false;
+				continue;
+			}
+			if (!read(property.countType, values[k]) || values[k] < 0.0 || values[k] > INT_MAX)
+				return false;
+			int count = int(values[k]);
+			if (count > maxItems(property.type))
+				return false;
+			if (k == list)
+				items.resize(count);
+			for (int j = 0; j < count; ++j)
+			{
+				double item;
+				if (!read(property.type, item))
+					return false;
+				if (k == list)
+				{
+					if (item < 0.0 || item > INT_MAX)
+						return false;
+					items[j] = int(item);
+				}
+			}
+		}
+		return true;
+	}
+
+	bool skip(const PlyElement& element)
+	{
+		int stride = element.stride();
+		if (format != PLY_ASCII && stride > 0)
+		{
+			if ((end - p) / stride < element.count)
+				return false;
+			p += element.count * stride;
+			return true;
+		}
+		vector<double> values(element.properties.size());
+		vector<int> items;
+		for (long long i = 0; i < element.count; ++i)
+		{
+			if (!read(element, values, -1, items))
+				return false;
+		}
+		return true;
+	}
+
+private:
+	// Most values of the type the rest of the file can hold
+	long long maxItems(PlyType type) const
+	{
+		if (format == PLY_ASCII)
+			return (end - p + 1) / 2;
+		return (end - p) / plySize(type);
+	}
+
+	const char* p;
+	const char* end;
+	PlyFormat format;
+	bool swap;
+};
+
+// Splits the header line at p into words and moves p to the next line
+static vector<string> headerLine(const char*& p, const char* end)
+{
+	vector<string> words;
+	while (p < end && *p != '\n')
+	{
+		skipBlanks(p, end);
+		const char* word = p;
+		while (p < end && *p != '\n' && !isBlank(*p))
+			++p;
+		if (p > word)
+			words.emplace_back(word, p);
+	}
+	if (p < end)
+		++p;
+	return words;
+}
+
+static bool readPly(const char* p, const char* end, Trimesh* mesh, string& error)
+{
+	headerLine(p, end);		// "ply"
+	PlyFormat format = PLY_ASCII;
+	vector<PlyElement> elements;
+	while (true)
+	{
+		if (p >= end)
+		{
+			error = "PLY header has no end_header";
+			return false;
+		}
+		vector<string> words = headerLine(p, end);
+		if (words.empty() || words[0] == "comment" || words[0] == "obj_info")
+			continue;
+		if (words[0] == "end_header")
+			break;
+		if (words[0] == "format" && words.size() >= 2)
+		{
+			if (words[1] == "ascii")
+				format = PLY_ASCII;
+			else if (words[1] == "binary_little_endian")
+				format = PLY_LITTLE_ENDIAN;
+			else if (words[1] == "binary_big_endian")
+				format = PLY_BIG_ENDIAN;
+			else
+			{
+				error = "unknown PLY format " + words[1];
+				return false;
+			}
+		}
+		else if (words[0] == "element" && words.size() >= 3)
+		{
+			PlyElement element;
+			element.name = words[1];
+			element.count = atoll(words[2].c_str());
+			elements.push_back(element);
+		}
+		else if (words[0] == "property" && !elements.empty() && words.size() >= 3)
+		{
+			PlyProperty property;
+			if (words[1] == "list" && words.size() >= 5)
+			{
+				property.countType = plyType(words[2]);
+				property.type = plyType(words[3]);
+				property.name = words[4];
+			}
+			else
+			{
+				property.countType = PLY_NONE;
+				property.type = plyType(words[1]);
+				property.name = words[2];
+			}
+			if (property.type == PLY_NONE || (property.countType == PLY_NONE && words[1] == "list"))
+			{
+				error = "unknown PLY property type";
+				return false;
+			}
+			elements.back().properties.push_back(property);
+		}
+		else
+		{
+			error = "bad PLY header line " + words[0];
+			return false;
+		}
+	}
+
+	static const char* const xNames[] = {"x", nullptr};
+	static const char* const yNames[] = {"y", nullptr};
+	static const char* const zNames[] = {"z", nullptr};
+	static const char* const nxNames[] = {"nx", nullptr};
+	static const char* const nyNames[] = {"ny", nullptr};
+	static const char* const nzNames[] = {"nz", nullptr};
+	static const char* const uNames[] = {"u", "s", "texture_u", "texture_s", nullptr};
+	static const char* const vNames[] = {"v", "t", "texture_v", "texture_t", nullptr};
+	static const char* const indexNames[] = {"vertex_indices", "vertex_index", nullptr};
+
+	// Counts the rest of the file can't hold are rejected before anything is
+	// reserved for them
+	long long left = end - p + 1;
+	for (const auto& element : elements)
+	{
+		int size = element.minSize(format);
+		if (element.count < 0 || element.count > INT_MAX)
+		{
+			error = "bad PLY " + element.name + " count";
+			return false;
+		}
+		if (size > 0 && element.count > left / size)
+		{
+			error = "PLY " + element.name + " count is more than the file holds";
+			return false;
+		}
+		left -= element.count * size;
+	}
+
+	long long numVertices = 0, numFaces = 0;
+	for (const auto& element : elements)
+	{
+		if (element.name == "vertex")
+			numVertices = element.count;
+		else if (element.name == "face")
+			numFaces = element.count;
+	}
+
+	PlyStream in(p, end, format);
+	vector<double> values;
+	vector<int> items;
+	for (const auto& element : elements)
+	{
+		values.resize(element.properties.size());
+		if (element.name == "vertex")
+		{
+			int x = element.find(xNames), y = element.find(yNames), z = element.find(zNames);
+			int nx = element.find(nxNames), ny = element.find(nyNames), nz = element.find(nzNames);
+			int u = element.find(uNames), v = element.find(vNames);
+			if (x < 0 || y < 0 || z < 0)
+			{
+				error = "PLY vertices have no x, y and z";
+				return false;
+			}
+			bool hasNormals = nx >= 0 && ny >= 0 && nz >= 0;
+			bool hasTexCoords = u >= 0 && v >= 0;
+			mesh->reserve(int(numVertices), int(numFaces), hasNormals, hasTexCoords);
+			if (hasTexCoords)
+				mesh->setEnableTexCoords(true);
+			for (long long i = 0; i < element.count; ++i)
+			{
+				if (!in.read(element, values, -1, items))
+				{
+					error = "PLY vertex data ends early";
+					return false;
+				}
+				mesh->addVertex(vec3f(values[x], values[y], values[z]));
+				if (hasNormals)
+					mesh->addNormal(vec3f(values[nx], values[ny], values[nz]));
+				if (hasTexCoords)
+					mesh->addTexCoords(values[u], values[v]);
+			}
+		}
+		else if (element.name == "face")
+		{
+			int indices = element.find(indexNames);
+			if (indices < 0 || element.properties[indices].countType == PLY_NONE)
+			{
+				error = "PLY faces have no vertex_indices list";
+				return false;
+			}
+			for (long long i = 0; i < element.count; ++i)
+			{
+				if (!in.read(element, values, indices, items))
+				{
+					error = "PLY face data ends early";
+					return false;
+				}
+				if (items.size() < 3)
+				{
+					error = "Faces must have at least 3 vertices.";
+					return false;
+				}
+				if (!addPolygon(mesh, items.data(), items.size()))
+				{
+					error = "Bad face in mesh file.";
+					return false;
+				}
+			}
+		}
+		else if (!in.skip(element))
+		{
+			error = "PLY " + element.name + " data ends early";
+			return false;
+		}
+	}
+	return true;
+}
+
+//
+// OBJ
+//
+
+// The position, texture coordinates and normal indices of a corner, from 0, -1 if missing
+struct ObjCorner
+{
+	int v, t, n;
+
+	bool operator==(const ObjCorner& other) const { return v == other.v && t == other.t && n == other.n; }
+};
+
+struct ObjCornerHash
+{
+	size_t operator()(const ObjCorner& c) const
+	{
+		return size_t(c.v) * 73856093u ^ size_t(c.t) * 19349663u ^ size_t(c.n) * 83492791u;
+	}
+};
+
+// OBJ indices count from 1, negative ones back from the last defined
+static bool objIndex(const char*& p, const char* end, int defined, int& index)
+{
+	long long value;
+	if (!parseInt(p, end, value) || value == 0)
+		return false;
+	value = value > 0 ? value - 1 : defined + value;
+	if (value < 0 || value >= defined)
+		return false;
+	index = int(value);
+	return true;
+}
+
+// OBJ files index positions, normals and texture coordinates separately, a
+// Trimesh vertex is made for every combination the faces use.  Files that use
+// only positions take them as they are.
+static bool readObj(const char* p, const char* end, Trimesh* mesh, string& error)
+{
+	vector<float> positions, normals, uvs;
+	vector<ObjCorner> corners;		// of the triangles
+	vector<ObjCorner> polygon;
+	bool anyT = false, anyN = false, allT = true, allN = true;
+	int line = 0;
+	auto fail = [&](const char* what)
+	{
+		error = string(what) + " on OBJ line " + std::to_string(line);
+		return false;
+	};
+
+	while (p < end)
+	{
+		++line;
+		const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+		if (eol == nullptr)
+			eol = end;
+		skipBlanks(p, eol);
+		int numValues = 0;
+		vector<float>* values = nullptr;
+		if (eol - p > 1 && p[0] == 'v' && isBlank(p[1]))
+		{
+			values = &positions;
+			numValues = 3;
+			p += 1;
+		}
+		else if (eol - p > 2 && p[0] == 'v' && p[1] == 'n' && isBlank(p[2]))
+		{
+			values = &normals;
+			numValues = 3;
+			p += 2;
+		}
+		else if (eol - p > 2 && p[0] == 'v' && p[1] == 't' && isBlank(p[2]))
+		{
+			values = &uvs;
+			numValues = 2;
+			p += 2;
+		}
+		else if (eol - p > 1 && p[0] == 'f' && isBlank(p[1]))
+		{
+			int numPositions = positions.size() / 3, numUVs = uvs.size() / 2, numNormals = normals.size() / 3;
+			polygon.clear();
+			++p;
+			while (true)
+			{
+				skipBlanks(p, eol);
+				if (p == eol)
+					break;
+				ObjCorner corner = {-1, -1, -1};
+				if (!objIndex(p, eol, numPositions, corner.v))
+					return fail("bad vertex index");
+				if (p < eol && *p == '/')
+				{
+					++p;
+					if (p < eol && *p != '/' && !objIndex(p, eol, numUVs, corner.t))
+						return fail("bad texture coordinate index");
+					if (p < eol && *p == '/')
+					{
+						++p;
+						if (!objIndex(p, eol, numNormals, corner.n))
+							return fail("bad normal index");
+					}
+				}
+				anyT = anyT || corner.t >= 0;
+				allT = allT && corner.t >= 0;
+				anyN = anyN || corner.n >= 0;
+				allN = allN && corner.n >= 0;
+				polygon.push_back(corner);
+			}
+			if (polygon.size() < 3)
+				return fail("face with less than 3 vertices");
+			for (size_t k = 2; k < polygon.size(); ++k)
+			{
+				corners.push_back(polygon[0]);
+				corners.push_back(polygon[k - 1]);
+				corners.push_back(polygon[k]);
+			}
+		}
+		if (values != nullptr)
+		{
+			for (int k = 0; k < numValues; ++k)
+			{
+				double value = 0.0;
+				skipBlanks(p, eol);
+				if (!parseReal(p, eol, value) && !(values == &uvs && k > 0))
+					return fail("bad number");
+				values->push_back(float(value));
+			}
+		}
+		p = eol < end ? eol + 1 : end;
+	}
+
+	// attributes only some corners have are left out
+	bool useT = anyT && allT, useN = anyN && allN;
+	int numTriangles = corners.size() / 3;
+	if (!useT && !useN)
+	{
+		int numPositions = positions.size() / 3;
+		mesh->reserve(numPositions, numTriangles, false, false);
+		for (int i = 0; i < numPositions; ++i)
+			mesh->addVertex(vec3f(positions[3 * i], positions[3 * i + 1], positions[3 * i + 2]));
+		for (int i = 0; i < numTriangles; ++i)
+			mesh->addFace(corners[3 * i].v, corners[3 * i + 1].v, corners[3 * i + 2].v);
+		return true;
+	}
+
+	std::unordered_map<ObjCorner, int, ObjCornerHash> vertexOf;
+	vertexOf.reserve(positions.size() / 3);
+	vector<int> ids(corners.size());
+	for (size_t k = 0; k < corners.size(); ++k)
+	{
+		ObjCorner corner = corners[k];
+		corner.t = useT ? corner.t : -1;
+		corner.n = useN ? corner.n : -1;
+		auto found = vertexOf.emplace(corner, int(vertexOf.size()));
+		ids[k] = found.first->second;
+		if (found.second)
+			corners[found.first->second] = corner;		// the unique corners take the front
+	}
+	int numVertices = vertexOf.size();
+	mesh->reserve(numVertices, numTriangles, useN, useT);
+	if (useT)
+		mesh->setEnableTexCoords(true);
+	for (int i = 0; i < numVertices; ++i)
+	{
+		const ObjCorner& corner = corners[i];
+		mesh->addVertex(vec3f(positions[3 * corner.v], positions[3 * corner.v + 1], positions[3 * corner.v + 2]));
+		if (useN)
+			mesh->addNormal(vec3f(normals[3 * corner.n], normals[3 * corner.n + 1], normals[3 * corner.n + 2]));
+		if (useT)
+			mesh->addTexCoords(uvs[2 * corner.t], uvs[2 * corner.t + 1]);
+	}
+	for (int i = 0; i < numTriangles; ++i)
+		mesh->addFace(ids[3 * i], ids[3 * i + 1], ids[3 * i + 2]);
+	return true;
+}
+
+bool readMeshFile(const string& filename, Trimesh* mesh, string& error)
+{
+	MappedFile file(filename);
+	if (!file.isOpen())
+	{
+		error = "couldn't read mesh file " + filename;
+		return false;
+	}
+
+	const char* p = file.begin();
+	const char* end = file.end();
+	bool ok;
+	try
+	{
+		if (end - p >= 4 && memcmp(p, "ply", 3) == 0 && (p[3] == '\n' || p[3] == '\r'))
+			ok = readPly(p, end, mesh, error);
+		else
+			ok = readObj(p, end, mesh, error);
+	}
+	catch (const std::bad_alloc&)
+	{
+		error = "out of memory";
+		ok = false;
+	}
+	catch (const std::length_error&)
+	{
+		error = "mesh is too big";
+		ok = false;
+	}
+	if (!ok)
+		error = filename + ": " + error;
+	return ok;
+}
@@ -0,0 +1,20 @@
+//
+// meshfile.h
+//
+// Loads the mesh_file of a trimesh, a PLY (ascii or binary) or an OBJ file.
+//
+
+#ifndef __MESHFILE_H__
+#define __MESHFILE_H__
+
+#include <string>
+
+#include "../SceneObjects/trimesh.h"
+
+// The file is memory mapped and parsed in place, the vertices, normals,
+// texture coordinates and faces go to mesh without a parse tree in between.
+// Polygons are split into fans as processTrimesh does.  Returns false with a
+// message in error if the file can't be read.
+bool readMeshFile(const string& filename, Trimesh* mesh, string& error);
+
+#endif // __MESHFILE_H__
@@ -12,10 +12,12 @@
 #include "read.h"
 
 #include "bitmap.h"
+#include "meshfile.h"
 #include "parse.h"
 
 #include "../scene/scene.h"
 #include "../SceneObjects/trimesh.h"
+#include "../SceneObjects/HeightField.h"
 #include "../SceneObjects/Box.h"
 #include "../SceneObjects/Cone.h"
 #include "../SceneObjects/Cylinder.h"
@@ -701,31 +703,40 @@ static void processTrimesh( string name, Obj *child, Scene *scene,
     
     Trimesh *tmesh = new Trimesh( scene, mat, transform);
 
-    const mytuple &points = getField( child, "points" )->getTuple();
-    for( mytuple::const_iterator pi = points.begin(); pi != points.end(); ++pi )
-        tmesh->addVertex( tupleToVec( *pi ) );
-                
-    const mytuple &faces = getField( child, "faces" )->getTuple();
-    for( mytuple::const_iterator fi = faces.begin(); fi != faces.end(); ++fi )
-    {
-        const mytuple &pointids = (*fi)->getTuple();
-
-        // triangulate here and now.  assume the poly is
-        // concave and we can triangulate using an arbitrary fan
-        if( pointids.size() < 3 )
-            throw ParseError( "Faces must have at least 3 vertices." );
-
-        mytuple::const_iterator i = pointids.begin();
-        int a = (int) (*i++)->getScalar();
-        int b = (int) (*i++)->getScalar();
-        while( i != pointids.end() )
-        {
-            int c = (int) (*i++)->getScalar();
-            if( !tmesh->addFace(a,b,c) )
-                throw ParseError( "Bad face in trimesh." );
-            b = c;
-        }
-    }
+	if (hasField(child, "mesh_file"))
+	{
+		string error;
+		if (!readMeshFile(getField(child, "mesh_file")->getString(), tmesh, error))
+			throw ParseError(error);
+	}
+	else
+	{
+		const mytuple &points = getField( child, "points" )->getTuple();
+		for( mytuple::const_iterator pi = points.begin(); pi != points.end(); ++pi )
+			tmesh->addVertex( tupleToVec( *pi ) );
+
+		const mytuple &faces = getField( child, "faces" )->getTuple();
+		for( mytuple::const_iterator fi = faces.begin(); fi != faces.end(); ++fi )
+		{
+			const mytuple &pointids = (*fi)->getTuple();
+
+			// triangulate here and now.  assume the poly is
+			// concave and we can triangulate using an arbitrary fan
+			if( pointids.size() < 3 )
+				throw ParseError( "Faces must have at least 3 vertices." );
+
+			mytuple::const_iterator i = pointids.begin();
+			int a = (int) (*i++)->getScalar();
+			int b = (int) (*i++)->getScalar();
+			while( i != pointids.end() )
+			{
+				int c = (int) (*i++)->getScalar();
+				if( !tmesh->addFace(a,b,c) )
+					throw ParseError( "Bad face in trimesh." );
+				b = c;
+			}
+		}
+	}
 
     bool generateNormals = false;
     maybeExtractField( child, "gennormals", generateNormals );
@@ -759,6 +770,19 @@ static void processTrimesh( string name, Obj *child, Scene *scene,
 		tmesh->setEmission(tupleToVec(getField(child, "emission")));
 	}
 
+	if (hasField(child, "vertex_format"))
+	{
+		string format = getField(child, "vertex_format")->getString();
+		if (format == "double")
+			tmesh->setVertexFormat(Trimesh::VertexFormat::Double);
+		else if (format == "float")
+			tmesh->setVertexFormat(Trimesh::VertexFormat::Float);
+		else if (format == "quantized")
+			tmesh->setVertexFormat(Trimesh::VertexFormat::Quantized);
+		else
+			throw ParseError("Unknown vertex_format \"" + format + "\", expected double, float or quantized.");
+	}
+
 	if (!processTexture(child, tmesh))
 		throw ParseError("Failed to load texture, please check texture format or path.");
 
@@ -771,41 +795,7 @@ static void processTrimesh( string name, Obj *child, Scene *scene,
 
 static bool processHField(Scene* scene, TransformNode*transform) {
 	Material* mat = new Material();
-	Trimesh* tmesh = new Trimesh(scene, mat, transform);
-	HFmap* thf = scene->hfmap;
-/*
-	const mytuple& points = getField(child, "points")->getTuple();
-	for (mytuple::const_iterator pi = points.begin(); pi != points.end(); ++pi)
-		tmesh->addVertex(tupleToVec(*pi));
-*/
-	for (double i = 0; i < thf->width; i++) {
-		for (double j = 0; j < thf->height; j++) {
-			double y = thf->getH(i, j) * thf->width / 255.0 / 100.0 - thf->width / 200.0 - 2;
-			y *= 0.2;
-			tmesh->addVertex(vec3f((i- thf->width / 2) / 100.0-2, y, (j - thf->height / 2) / 100.0 - 2));
-			auto diffuse = thf->getC(i, j)/255.0;
-			Material* tempmat = new Material();
-			tempmat->kd = diffuse;
-		//empmat->ks = vec3f(0.5, 0.5, 0.5);
-		//empmat->shininess = 0.2;
-			tmesh->addMaterial(tempmat);
-		}
-	}
-
-	for (double i = 0; i < thf->width-1; i++) {
-		for (double j = 0; j < thf->height-1; j++) {
-			tmesh->addFace(i * thf->height + j,i* thf->height + j + 1, (i+1) * thf->height + j + 1);
-			tmesh->addFace(i * thf->height + j, (i + 1) * thf->height + j+1, (i + 1) * thf->height + j );
-		}
-	}
-
-	tmesh->generateNormals();
-
-	char* error;
-	if (error = tmesh->doubleCheck())
-		throw ParseError(error);
-
-	scene->add(tmesh);
+	scene->add(new HeightField(scene, mat, transform, scene->hfmap));
 	return true;
 
 	/*
@@ -55,6 +55,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include <FL/Fl.h>
@@ -67,7 +68,7 @@
 #include "RayTracer.h"
 
 #include "fileio/bitmap.h"
-#include <random>
+#include <chrono>
 
 // ***********************************************************
 // from getopt.cpp 
@@ -88,21 +89,24 @@ int recursion_depth = 0;
 int g_height;
 int g_width = 150;
 bool bReport = false;
+BVH::SplitMethod bvhSplitMethod = BVH::SplitMethod::SAH;
+char *bvhCacheDir = nullptr;
+bool bPackets = true;
+int numThreads = 0;
 char *progname, *rayName, *imgName;
 
-// Global random number generator
-std::random_device rand_dev;
-std::mt19937_64 rng(rand_dev());
-std::uniform_real_distribution<double> unif(0.0, 1.0);
-
 void usage()
 {
 #ifdef WIN32
-	fl_alert( "usage: %s [-r <#> -w <#> -t] [input.ray output.bmp]\n", progname );
+	fl_alert( "usage: %s [-r <#> -w <#> -j <#> -b <median|sah|sbvh> -c <dir> -n -t] [input.ray output.bmp]\n", progname );
 #else
 	fprintf( stderr, "usage: %s [options] [input.ray output.bmp]\n", progname );
 	fprintf( stderr, "  -r <#>      set recurssion level (default %d)\n", recursion_depth );
 	fprintf( stderr, "  -w <#>      set output image width (default %d)\n", g_width );
+	fprintf( stderr, "  -j <#>      render on # threads (default one per core)\n" );
+	fprintf( stderr, "  -b <method> BVH split method, median, sah or sbvh (default sah)\n" );
+	fprintf( stderr, "  -c <dir>    keep built BVHs in dir and reuse them for the same scene\n" );
+	fprintf( stderr, "  -n          trace every camera ray on its own instead of in packets\n" );
 	fprintf( stderr, "  -t			report time statistics\n" );
 #endif
 }
@@ -110,13 +114,17 @@ void usage()
 bool processArgs(int argc, char **argv) {
 	int i;
 
-    while ( (i = getopt( argc, argv, "tr:w:h:" )) != EOF )
+    while ( (i = getopt( argc, argv, "tnr:w:h:j:b:c:" )) != EOF )
 	{
 		switch ( i )
 		{
 			case 't':
 			bReport = true;
 			break;
+
+			case 'n':
+			bPackets = false;
+			break;
 	    
 			case 'r':
 			recursion_depth = atoi( optarg );
@@ -130,6 +138,25 @@ bool processArgs(int argc, char **argv) {
 			g_height = atoi( optarg );
 			break;
 
+			case 'j':
+			numThreads = atoi( optarg );
+			break;
+
+			case 'b':
+			if ( !strcmp( optarg, "median" ) )
+				bvhSplitMethod = BVH::SplitMethod::Median;
+			else if ( !strcmp( optarg, "sah" ) )
+				bvhSplitMethod = BVH::SplitMethod::SAH;
+			else if ( !strcmp( optarg, "sbvh" ) )
+				bvhSplitMethod = BVH::SplitMethod::SBVH;
+			else
+				return false;
+			break;
+
+			case 'c':
+			bvhCacheDir = optarg;
+			break;
+
 			default:
 			return false;
 		}
@@ -166,6 +193,11 @@ int main(int argc, char **argv) {
 		}
 		
 		theRayTracer=new RayTracer();
+		theRayTracer->bvhSplitMethod = bvhSplitMethod;
+		if (bvhCacheDir != nullptr)
+			theRayTracer->bvhCacheDir = bvhCacheDir;
+		theRayTracer->enablePackets = bPackets;
+		theRayTracer->setNumThreads(numThreads);
 		theRayTracer->loadScene(rayName);
 	
 		if (theRayTracer->sceneLoaded()) {
@@ -173,12 +205,12 @@ int main(int argc, char **argv) {
 
 			theRayTracer->traceSetup(g_width, g_height, recursion_depth, {0.0, 0.0, 0.0});
 		
-			clock_t start, end;
-			start=clock();
+			// wall clock, clock() adds up the time of all the render threads
+			auto start = std::chrono::steady_clock::now();
 
 			theRayTracer->traceLines(0, g_height);
 		
-			end=clock();
+			auto end = std::chrono::steady_clock::now();
 
 			// save image
 			unsigned char* buf;
@@ -188,11 +220,12 @@ int main(int argc, char **argv) {
 				writeBMP(imgName, g_width, g_height, buf); 
 
 			if (bReport) {
-				double t=(double)(end-start)/CLOCKS_PER_SEC;
+				double t = std::chrono::duration<double>(end - start).count();
 #ifdef WIN32
-				fl_message( "total time = %.3f seconds\n", t); 
+				fl_message( "total time = %.3f seconds\nBVH SAH cost = %.3f\n", t, theRayTracer->getBVHCost()); 
 #else
 				fprintf( stderr, "total time = %.3f seconds\n", t); 
+				fprintf( stderr, "BVH SAH cost = %.3f\n", theRayTracer->getBVHCost()); 
 #endif
 			}
 		}
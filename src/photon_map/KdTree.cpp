@@ -1,79 +1,144 @@
 #include "KdTree.h"
+#include "../TileScheduler.h"
 #include <algorithm>
 #include <cmath>
 
 using namespace std;
 
-Photon* KdTree::getMedian(int l, int r, int dimension)
-{
-	nth_element(photons.begin() + l, photons.begin() + (l + r) / 2, photons.begin() + r, 
-		[dimension] (const Photon* a, const Photon* b) { return a->position[dimension] < b->position[dimension]; });
-	return photons[(l + r) / 2];
-}
+const int KdTree::maxNeighbours;
 
-vector<Photon*> KdTree::getKnn(const vec3f& pos, int k, double maxDist)
+int KdTree::getKnn(const vec3f& pos, int k, double maxDist, Neighbour* nearest) const
 {
-	knn = priority_queue<Pair>{less<Pair>(), vector<Pair>{(unsigned)k, {nullptr, numeric_limits<double>::lowest()}}};
-	traverse(pos, root, maxDist);
-	vector<Photon*> result;
-	while (!knn.empty())
-	{
-		auto cur = knn.top();
-		knn.pop();
-		if (cur.photon != nullptr) 
-			result.push_back(cur.photon);
-	}
-	return result;
+	KnnQuery query{pos, nearest, k, 0, maxDist * maxDist};
+	if (k > 0)
+		traverse(query, 0);
+	return query.size;
 }
 
-// TODO: add optimization: do not build the heap before the required number of photons are collected
-void KdTree::traverse(const vec3f& pos, Node* cur, double maxDist)
+// The photons are only made a heap once k of them are found, from then on
+// each closer one replaces the farthest and the radius shrinks to the new farthest
+void KdTree::traverse(KnnQuery& query, int cur) const
 {
-	if (cur == nullptr)	return;
-	double dist = pos[cur->dimension] - cur->photon->position[cur->dimension];
+	if (cur >= size())	return;
+	const Photon& photon = tree[cur];
+	double dist = query.pos[photon.axis] - photon.position[photon.axis];
 
-	if (dist < 0) traverse(pos, cur->left, maxDist);
-	else traverse(pos, cur->right, maxDist);
+	if (dist < 0) traverse(query, 2 * cur + 1);
+	else traverse(query, 2 * cur + 2);
 	
-	double curDist2 = (pos - cur->photon->position).length_squared();
-
-	if (sqrt(curDist2) <= maxDist)
+	double curDist2 = (query.pos - vec3f(photon.position)).length_squared();
+	if (curDist2 <= query.radius2)
 	{
-		knn.push({cur->photon, -curDist2});
-		knn.pop();
+		Neighbour* nearest = query.nearest;
+		if (query.size < query.k)
+		{
+			nearest[query.size++] = {&photon, curDist2};
+			if (query.size == query.k)
+			{
+				make_heap(nearest, nearest + query.k);
+				query.radius2 = nearest[0].distance2;
+			}
+		}
+		else
+		{
+			pop_heap(nearest, nearest + query.k);
+			nearest[query.k - 1] = {&photon, curDist2};
+			push_heap(nearest, nearest + query.k);
+			query.radius2 = nearest[0].distance2;
+		}
 	}
 	
-	if (-knn.top().distance > std::abs(dist))
+	if (dist * dist < query.radius2)
 	{
-		if (dist < 0) traverse(pos, cur->right, maxDist);
-		else traverse(pos, cur->left, maxDist);
+		if (dist < 0) traverse(query, 2 * cur + 2);
+		else traverse(query, 2 * cur + 1);
 	}
 }
 
-double KdTree::getRange(int l, int r, int dimension)
+double KdTree::getRange(int l, int r, int dimension) const
 {
-	double minV = photons[l]->position[dimension], maxV = minV;
+	double minV = photons[l].position[dimension], maxV = minV;
 	for (auto iter = photons.begin() + l, end = photons.begin() + r; iter != end; ++iter)
 	{
-		minV = min(minV, (*iter)->position[dimension]);
-		maxV = max(maxV, (*iter)->position[dimension]);
+		minV = min(minV, double(iter->position[dimension]));
+		maxV = max(maxV, double(iter->position[dimension]));
 	}
 	return maxV - minV;
 }
 
-KdTree::KdTree(vector<Photon*>& photons, int dimension): photons(photons), totDim(dimension)
+// All levels but the last are full and the last one fills from the left, so
+// the left subtree has the full levels below the root and as much of the last
+// level as fits in it
+int KdTree::leftSize(int n)
+{
+	if (n <= 1)
+		return 0;
+	int full = 1;		// nodes of the levels above the last, plus one
+	while (full * 2 <= n + 1)
+		full *= 2;
+	int last = n - (full - 1);
+	return (full / 2 - 1) + min(last, full / 2);
+}
+
+KdTree::KdTree(vector<Photon> photons, int dimension, TileScheduler* scheduler): photons(std::move(photons)), totDim(dimension)
 {
-	root = build(0, photons.size());
+	int n = int(this->photons.size());
+	tree.resize(n);
+	if (scheduler == nullptr)
+	{
+		build(0, n, 0);
+		this->photons = vector<Photon>();
+		return;
+	}
+
+	// The ranges of a level are split at once, a level after the other, until
+	// there are enough subtrees to keep the threads busy
+	struct Range
+	{
+		int l, r;
+		int index;
+	};
+	vector<Range> level;
+	if (n > 0)
+		level.push_back({0, n, 0});
+	int subtrees = 4 * scheduler->getNumThreads();
+	while (!level.empty() && int(level.size()) < subtrees)
+	{
+		scheduler->parallelFor(int(level.size()), 1, [&](int begin, int end)
+		{
+			for (int i = begin; i < end; ++i)
+				makeNode(level[i].l, level[i].r, level[i].index);
+		});
+		vector<Range> next;
+		for (const Range& range : level)
+		{
+			int mid = range.l + leftSize(range.r - range.l);
+			if (range.l < mid)
+				next.push_back({range.l, mid, 2 * range.index + 1});
+			if (mid + 1 < range.r)
+				next.push_back({mid + 1, range.r, 2 * range.index + 2});
+		}
+		level.swap(next);
+	}
+	scheduler->parallelFor(int(level.size()), 1, [&](int begin, int end)
+	{
+		for (int i = begin; i < end; ++i)
+			build(level[i].l, level[i].r, level[i].index);
+	});
+	this->photons = vector<Photon>();
 }
 
-KdTree::~KdTree()
+void KdTree::build(int l, int r, int index)
 {
-	delete root;
+	if (l >= r)	return;
+	makeNode(l, r, index);
+	int mid = l + leftSize(r - l);
+	build(l, mid, 2 * index + 1);
+	build(mid + 1, r, 2 * index + 2);
 }
 
-KdTree::Node* KdTree::build(int l, int r)
+void KdTree::makeNode(int l, int r, int index)
 {
-	if (l >= r)	return nullptr;
 	int dimension = 0;
 	double range = getRange(l, r, dimension);
 
@@ -87,8 +152,9 @@ KdTree::Node* KdTree::build(int l, int r)
 		}
 	}
 	
-	Node* cur = new Node(getMedian(l, r, dimension), dimension);
-	cur->left = build(l, (l + r) / 2);
-	cur->right = build((l + r) / 2 + 1, r);
-	return cur;
+	int mid = l + leftSize(r - l);
+	nth_element(photons.begin() + l, photons.begin() + mid, photons.begin() + r, 
+		[dimension] (const Photon& a, const Photon& b) { return a.position[dimension] < b.position[dimension]; });
+	tree[index] = photons[mid];
+	tree[index].axis = uint8_t(dimension);
 }
@@ -1,47 +1,55 @@
 #pragma once
 
 #include <vector>
-#include <queue>
 #include "Photon.h"
 
+class TileScheduler;
+
+// The photons in one array as a left-balanced kd-tree: the children of the
+// photon at i are at 2i + 1 and 2i + 2, so the tree needs no pointers and
+// the top levels, which every query reads, sit together at the front.
 class KdTree
 {
 public:
-	// TODO: memory optimization: use a heap-like structure instead of storing child pointers
-	class Node
+	// A photon found by getKnn and its squared distance to the query point
+	class Neighbour
 	{
 	public:
-		Node(Photon* photon, int dimension): photon(photon), dimension(dimension) { }
-		~Node() { delete left; delete right; }
-		
-		Photon* photon;
-		Node* left{nullptr}, *right{nullptr};
-		int dimension;
+		const Photon* photon;
+		double distance2;
+		friend bool operator<(const Neighbour& a, const Neighbour& b) { return a.distance2 < b.distance2; }
 	};
+	static const int maxNeighbours{128};		// for buffers on the stack
 
-	class Pair
-	{
-	public:
-		Photon* photon;
-		double distance;
-		friend bool operator<(const Pair& a, const Pair& b) { return a.distance > b.distance; }
-	};
+	// The top of the tree is split on the threads of scheduler, if there is
+	// one, and the subtrees below are built on them too
+	KdTree(std::vector<Photon> photons, int dimension, TileScheduler* scheduler = nullptr);
+
+	// The at most k photons within maxDist of pos closest to it, put in
+	// nearest, which has room for k, returns how many.  Keeps no state so
+	// any number of threads can query at once.
+	int getKnn(const vec3f& pos, int k, double maxDist, Neighbour* nearest) const;
 
-	KdTree(std::vector<Photon*>& photons, int dimension);
-	~KdTree();
-	
-	Node* build(int l, int r);
-	Photon* getMedian(int l, int r, int dimension);
-	std::vector<Photon*> getKnn(const vec3f& pos, int k, double maxDist);
-	
-	std::vector<Photon*>& photons;
+	int size() const { return int(tree.size()); }
 
 private:
-	void traverse(const vec3f& pos, Node* cur, double maxDist);
-	double getRange(int l, int r, int dimension);
+	// The state of a query, nearest is a max-heap of the closest photons so far
+	struct KnnQuery
+	{
+		vec3f pos;
+		Neighbour* nearest;
+		int k;
+		int size;
+		double radius2;		// the search radius, shrinks once k are found
+	};
 
-	std::priority_queue<Pair> knn;
-	Node* root{nullptr};
+	void traverse(KnnQuery& query, int cur) const;
+	void build(int l, int r, int index);
+	void makeNode(int l, int r, int index);		// puts the photon splitting [l, r) at index
+	static int leftSize(int n);		// of a left-balanced tree of n photons
+	double getRange(int l, int r, int dimension) const;
+
+	std::vector<Photon> photons;		// in the order the build sorts them
+	std::vector<Photon> tree;
 	int totDim;
 };
-
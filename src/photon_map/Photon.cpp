@@ -1 +1,39 @@
 ﻿#include "Photon.h"
+
+Photon::Photon(const vec3f& position, const vec3f& direction, const vec3f& power): position(position)
+{
+	double largest = _max(power[0], _max(power[1], power[2]));
+	if (largest < 1e-32)
+	{
+		for (int i = 0; i < 4; ++i)
+			this->power[i] = 0;
+	}
+	else
+	{
+		int exponent;
+		double scale = frexp(largest, &exponent) * 256.0 / largest;
+		for (int i = 0; i < 3; ++i)
+			this->power[i] = uint8_t(_min(_max(power[i], 0.0) * scale, 255.0));
+		this->power[3] = uint8_t(exponent + 128);
+	}
+
+	int t = int(acos(_min(_max(direction[2], -1.0), 1.0)) * (256.0 / PI));
+	int p = int(atan2(direction[1], direction[0]) * (256.0 / PI_2)) + 128;
+	theta = uint8_t(min(t, 255));
+	phi = uint8_t(min(max(p, 0), 255));
+}
+
+vec3f Photon::getDirection() const
+{
+	double t = (theta + 0.5) * (PI / 256.0);
+	double p = (phi - 127.5) * (PI_2 / 256.0);
+	return vec3f(sin(t) * cos(p), sin(t) * sin(p), cos(t));
+}
+
+vec3f Photon::getPower() const
+{
+	if (power[3] == 0)
+		return vec3f();
+	double scale = ldexp(1.0, power[3] - (128 + 8));
+	return vec3f((power[0] + 0.5) * scale, (power[1] + 0.5) * scale, (power[2] + 0.5) * scale);
+}
@@ -1,12 +1,23 @@
 ﻿#pragma once
 
+#include <cstdint>
+
 #include "../vecmath/vecmath.h"
 
+// A photon stored in the photon map, 20 bytes: a float position, the power
+// in RGBE (a shared exponent, as Radiance keeps colors) and the direction
+// it came from in spherical angles of 8 bits each
 class Photon
 {
 public:
-	// TODO: memory optimization: switch to vec3 of float type or more compact type
-	vec3f position;
-	vec3f direction;
-	vec3f power;
+	Photon() { }
+	Photon(const vec3f& position, const vec3f& direction, const vec3f& power);
+
+	vec3f getDirection() const;
+	vec3f getPower() const;
+
+	float3 position;
+	uint8_t power[4];
+	uint8_t theta, phi;
+	uint8_t axis{0};	// the kd-tree splits at the photon on it
 };
@@ -0,0 +1,325 @@
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include "bvhcache.h"
+
+const uint32_t BVHCache::version;
+
+static const char magic[8] = {'T', 'R', 'B', 'V', 'H', 'C', 0, 0};
+static const size_t headerSize = 16;		// magic, version, number of records
+static const size_t recordHeaderSize = 16;	// key, number of nodes, number of slots
+
+BVHCache::BVHCache(const string& path)
+	: path(path)
+{
+	map();
+}
+
+BVHCache::~BVHCache()
+{
+	unmap();
+}
+
+string BVHCache::pathFor(const string& dir, const string& sceneFile)
+{
+	std::ifstream ifs(sceneFile.c_str(), std::ios::binary);
+	std::stringstream contents;
+	contents << ifs.rdbuf();
+	string scene = contents.str();
+	uint64_t h = hash(&version, sizeof(version));
+	h = hash(scene.data(), scene.size(), h);
+
+	char name[32];
+	sprintf(name, "%016llx.bvh", (unsigned long long) h);
+	return dir + "/" + name;
+}
+
+// FNV-1a
+uint64_t BVHCache::hash(const void* data, size_t size, uint64_t seed)
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	uint64_t h = seed;
+	for (size_t i = 0; i < size; ++i)
+	{
+		h ^= bytes[i];
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+uint64_t BVHCache::key(const BVH& bvh, const vector<BoundingBox>& boxes)
+{
+	int32_t settings[] = {int32_t(bvh.splitMethod), bvh.threshold, bvh.maxLeafSize, BVH::numBins};
+	double costs[] = {bvh.traversalCost, bvh.intersectCost, bvh.maxDuplication, bvh.spatialSplitAlpha};
+	uint64_t h = hash(settings, sizeof(settings));
+	h = hash(costs, sizeof(costs), h);
+	h = hash(&bvh.contentKey, sizeof(bvh.contentKey), h);
+	for (const auto& box : boxes)
+	{
+		double bounds[6] = {box.min[0], box.min[1], box.min[2], box.max[0], box.max[1], box.max[2]};
+		h = hash(bounds, sizeof(bounds), h);
+	}
+	return h;
+}
+
+// A damaged or forged record must not send a traversal out of the arrays or
+// past its stack: children have to come after their parent, leaves have to
+// stay within the slots, slots have to name one of the boxes, and the tree
+// has to respect the depth limit of the builders
+static bool isValid(const vector<LinearBVHNode>& nodes, const vector<int>& order, size_t numBoxes)
+{
+	if (nodes.empty())
+		return false;
+	for (int prim : order)
+	{
+		if (prim < 0 || size_t(prim) >= numBoxes)
+			return false;
+	}
+
+	vector<std::pair<int, int>> stack;		// index and depth of the nodes to check
+	stack.push_back({0, 0});
+	size_t visited = 0;
+	while (!stack.empty())
+	{
+		int index = stack.back().first, depth = stack.back().second;
+		stack.pop_back();
+		const LinearBVHNode& node = nodes[index];
+		if (++visited > nodes.size())		// shared subtrees
+			return false;
+		if (node.count > 0)
+		{
+			if (node.offset < 0 || size_t(node.offset) + size_t(node.count) > order.size())
+				return false;
+			continue;
+		}
+		if (node.count < 0 || node.axis < 0 || node.axis > 2 || depth >= BVH::maxDepth ||
+			index + 1 >= int(nodes.size()) || node.offset <= index + 1 || size_t(node.offset) >= nodes.size())
+			return false;
+		stack.push_back({index + 1, depth + 1});
+		stack.push_back({node.offset, depth + 1});
+	}
+	return visited == nodes.size();
+}
+
+// The nodes are copied out of the mapping rather than used in place: the file
+// keeps double bounds, LinearBVHNode float ones, and refit updates and
+// rebuilds the nodes of the BVH, which the read only mapping could not take.
+bool BVHCache::load(BVH& bvh, const vector<BoundingBox>& boxes)
+{
+	auto record = offsets.find(key(bvh, boxes));
+	if (record == offsets.end())
+		return false;
+
+	const char* p = data + record->second + sizeof(uint64_t);
+	uint32_t numNodes, numSlots;
+	memcpy(&numNodes, p, sizeof(numNodes));
+	memcpy(&numSlots, p + sizeof(numNodes), sizeof(numSlots));
+	p += 2 * sizeof(uint32_t);
+
+	bvh.nodes.resize(numNodes);
+	for (auto& node : bvh.nodes)
+	{
+		FileNode fileNode;
+		memcpy(&fileNode, p, sizeof(fileNode));
+		p += sizeof(fileNode);
+		node.aabb.min = vec3f(fileNode.min[0], fileNode.min[1], fileNode.min[2]);
+		node.aabb.max = vec3f(fileNode.max[0], fileNode.max[1], fileNode.max[2]);
+		node.offset = fileNode.offset;
+		node.count = fileNode.count;
+		node.axis = fileNode.axis;
+		node.relArea = fileNode.relArea;
+	}
+	bvh.order.resize(numSlots);
+	if (numSlots > 0)
+		memcpy(&bvh.order[0], p, numSlots * sizeof(int32_t));
+	if (isValid(bvh.nodes, bvh.order, boxes.size()))
+		return true;
+
+	// build it again, that replaces the record
+	bvh.nodes.clear();
+	bvh.order.clear();
+	return false;
+}
+
+void BVHCache::store(const BVH& bvh, const vector<BoundingBox>& boxes)
+{
+	Record& record = records[key(bvh, boxes)];
+	record.nodes.resize(bvh.nodes.size());
+	for (size_t i = 0; i < bvh.nodes.size(); ++i)
+	{
+		const LinearBVHNode& node = bvh.nodes[i];
+		FileNode& fileNode = record.nodes[i];
+		for (int k = 0; k < 3; ++k)
+		{
+			fileNode.min[k] = node.aabb.min[k];
+			fileNode.max[k] = node.aabb.max[k];
+		}
+		fileNode.offset = node.offset;
+		fileNode.count = node.count;
+		fileNode.axis = node.axis;
+		fileNode.relArea = node.relArea;
+	}
+	record.order.assign(bvh.order.begin(), bvh.order.end());
+	dirty = true;
+}
+
+bool BVHCache::save()
+{
+	if (!dirty)
+		return true;
+
+	// keep what the file had, it has to be unmapped before it is replaced
+	for (const auto& entry : offsets)
+	{
+		if (records.count(entry.first))
+			continue;
+		const char* p = data + entry.second + sizeof(uint64_t);
+		uint32_t numNodes, numSlots;
+		memcpy(&numNodes, p, sizeof(numNodes));
+		memcpy(&numSlots, p + sizeof(numNodes), sizeof(numSlots));
+		p += 2 * sizeof(uint32_t);
+		Record& record = records[entry.first];
+		record.nodes.resize(numNodes);
+		record.order.resize(numSlots);
+		if (numNodes > 0)
+			memcpy(&record.nodes[0], p, numNodes * sizeof(FileNode));
+		if (numSlots > 0)
+			memcpy(&record.order[0], p + numNodes * sizeof(FileNode), numSlots * sizeof(int32_t));
+	}
+	unmap();
+
+	// write a file of our own next to it and move that over it, so other
+	// processes using the cache never see it half written
+#ifdef _WIN32
+	int pid = _getpid();
+#else
+	int pid = getpid();
+#endif
+	string temp = path + "." + std::to_string(pid) + ".tmp";
+	FILE* file = fopen(temp.c_str(), "wb");
+	if (file == nullptr)
+		return false;
+	uint32_t count = records.size();
+	bool ok = fwrite(magic, sizeof(magic), 1, file) == 1 &&
+		fwrite(&version, sizeof(version), 1, file) == 1 &&
+		fwrite(&count, sizeof(count), 1, file) == 1;
+	for (const auto& entry : records)
+	{
+		const Record& record = entry.second;
+		uint32_t numNodes = record.nodes.size(), numSlots = record.order.size();
+		ok = ok && fwrite(&entry.first, sizeof(entry.first), 1, file) == 1 &&
+			fwrite(&numNodes, sizeof(numNodes), 1, file) == 1 &&
+			fwrite(&numSlots, sizeof(numSlots), 1, file) == 1 &&
+			fwrite(record.nodes.data(), sizeof(FileNode), numNodes, file) == numNodes &&
+			fwrite(record.order.data(), sizeof(int32_t), numSlots, file) == numSlots;
+	}
+	ok = fclose(file) == 0 && ok;
+#ifdef _WIN32
+	ok = ok && MoveFileExA(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	ok = ok && rename(temp.c_str(), path.c_str()) == 0;
+#endif
+	if (!ok)
+		remove(temp.c_str());
+	dirty = false;
+	return ok;
+}
+
+// Map the file and find its records, a file of another version or a damaged
+// one is ignored and written again
+bool BVHCache::map()
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER fileSize;
+	if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+	{
+		size = size_t(fileSize.QuadPart);
+		handle = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (handle != NULL)
+			data = static_cast<const char*>(MapViewOfFile(handle, FILE_MAP_READ, 0, 0, 0));
+	}
+	CloseHandle(file);
+#else
+	int file = open(path.c_str(), O_RDONLY);
+	if (file < 0)
+		return false;
+	struct stat status;
+	if (fstat(file, &status) == 0 && status.st_size > 0)
+	{
+		size = size_t(status.st_size);
+		void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+		if (mapped != MAP_FAILED)
+			data = static_cast<const char*>(mapped);
+	}
+	close(file);
+#endif
+	if (data == nullptr)
+	{
+		unmap();
+		return false;
+	}
+
+	uint32_t fileVersion, count;
+	if (size < headerSize || memcmp(data, magic, sizeof(magic)) != 0)
+	{
+		unmap();
+		return false;
+	}
+	memcpy(&fileVersion, data + sizeof(magic), sizeof(fileVersion));
+	memcpy(&count, data + sizeof(magic) + sizeof(fileVersion), sizeof(count));
+	if (fileVersion != version)
+	{
+		unmap();
+		return false;
+	}
+
+	size_t pos = headerSize;
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		uint64_t recordKey;
+		uint32_t numNodes, numSlots;
+		if (pos + recordHeaderSize > size)
+			break;
+		memcpy(&recordKey, data + pos, sizeof(recordKey));
+		memcpy(&numNodes, data + pos + sizeof(recordKey), sizeof(numNodes));
+		memcpy(&numSlots, data + pos + sizeof(recordKey) + sizeof(numNodes), sizeof(numSlots));
+		size_t length = recordHeaderSize + size_t(numNodes) * sizeof(FileNode) + size_t(numSlots) * sizeof(int32_t);
+		if (length > size - pos)
+			break;
+		offsets[recordKey] = pos;
+		pos += length;
+	}
+	return true;
+}
+
+void BVHCache::unmap()
+{
+#ifdef _WIN32
+	if (data != nullptr)
+		UnmapViewOfFile(data);
+	if (handle != nullptr)
+		CloseHandle(handle);
+#else
+	if (data != nullptr)
+		munmap(const_cast<char*>(data), size);
+#endif
+	data = nullptr;
+	handle = nullptr;
+	size = 0;
+	offsets.clear();
+}
@@ -0,0 +1,66 @@
+//
+// bvhcache.h
+//
+// Built BVHs saved to a file, so later runs of the same scene skip the builds.
+//
+
+#ifndef __BVHCACHE_H__
+#define __BVHCACHE_H__
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "scene.h"
+
+// The cache file of a scene is named by a hash of the scene file, and maps the
+// hash of the primitive boxes and build settings of every BVH in it to its
+// nodes and primitive order.  The file is memory mapped, a BVH that is found
+// is copied out of it instead of being built, and the file is replaced
+// if anything had to be built.
+class BVHCache
+{
+public:
+	static const uint32_t version{1};
+
+	explicit BVHCache(const string& path);
+	~BVHCache();
+
+	// File of the scene file in directory dir
+	static string pathFor(const string& dir, const string& sceneFile);
+	static uint64_t hash(const void* data, size_t size, uint64_t seed = 14695981039346656037ull);
+
+	// Fill nodes and order of bvh if it was built over these boxes before
+	bool load(BVH& bvh, const vector<BoundingBox>& boxes);
+	void store(const BVH& bvh, const vector<BoundingBox>& boxes);
+	bool save();		// write the file if something was stored
+
+private:
+	// Layout of a node in the file
+	struct FileNode
+	{
+		double min[3], max[3];
+		int32_t offset, count, axis;
+		float relArea;
+	};
+	struct Record
+	{
+		vector<FileNode> nodes;
+		vector<int32_t> order;
+	};
+
+	static uint64_t key(const BVH& bvh, const vector<BoundingBox>& boxes);
+	bool map();
+	void unmap();
+
+	string path;
+	const char* data{nullptr};		// the mapped file
+	size_t size{0};
+	void* handle{nullptr};			// of the mapping on Windows
+	std::map<uint64_t, size_t> offsets;		// record of a key in the mapped file
+	std::map<uint64_t, Record> records;		// records to write
+	bool dirty{false};
+};
+
+#endif // __BVHCACHE_H__
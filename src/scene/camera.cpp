@@ -22,7 +22,7 @@ Camera::rayThrough( double x, double y, Ray &r )
 {
 	double time = 0.0;
 	if (enableMotionBlur)
-		time = ((double) rand() / RAND_MAX) * (time1 - time0) + time0;
+		time = getRandomReal(time0, time1);
 	if (!enableDof)
 	{
 		x -= 0.5;
@@ -119,7 +119,7 @@ vec3f Camera::uniformSampleDisk()
 {
 	while (true)
 	{
-		double x = ((double)rand() / RAND_MAX) - 0.5, y = ((double)rand() / RAND_MAX) - 0.5;
+		double x = getRandomReal() - 0.5, y = getRandomReal() - 0.5;
 		vec3f offset(x, y, 0.0);
 		if (offset.length_squared() < 1.0)
             return offset;
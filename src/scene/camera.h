@@ -26,6 +26,9 @@ public:
 	const vec3f& getEye() { return eye; }
 	const vec3f& getLook() { return look; }
 	double getFov() const { return fov; }
+	// Times the rays are spread over, both 0 without motion blur
+	double getShutterOpen() const { return enableMotionBlur ? time0 : 0.0; }
+	double getShutterClose() const { return enableMotionBlur ? time1 : 0.0; }
 
 private:
 	void update();              // using the above three values calculate look,u,v
@@ -36,8 +39,8 @@ private:
     double normalizedHeight;    // dimensions of image place at unit dist from eye
     double aspectRatio;
 	double fov;
-	double time0, time1;			// time to open the shutter
-	bool enableMotionBlur;
+	double time0{0.0}, time1{0.0};			// time to open the shutter
+	bool enableMotionBlur{false};
 	
 	// Depth of field
 	bool enableDof{false};
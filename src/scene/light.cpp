@@ -15,11 +15,7 @@ vec3f DirectionalLight::shadowAttenuation( const vec3f& P, double t ) const
     // YOUR CODE HERE:
     // You should implement shadow-handling code here.
 
-	Ray r(P, -orientation, t);
-	Isect isect;
-	if (scene->bvhIntersect(r, isect))
-		return isect.getMaterial().kt;
-    return vec3f(1,1,1);
+	return scene->transmittance(Ray(P, -orientation, t), 1.0e308);
 }
 
 vec3f DirectionalLight::getColor( const vec3f& P ) const
@@ -33,16 +29,13 @@ vec3f DirectionalLight::getDirection( const vec3f& P ) const
 	return -orientation;
 }
 
-Photon* DirectionalLight::emitPhoton() const
+Ray DirectionalLight::emitPhoton(vec3f& power) const
 {
 	int idx = round(getRandomReal() * (cells.size() - 1));
-	auto* photon = new Photon;
 	double x = cells[idx] % mapSize + getRandomReal(), y = cells[idx] / mapSize + getRandomReal();
-	photon->position = unproject(x, y);
-	photon->direction = orientation;
-	photon->power = color * PI * sceneRadius * sceneRadius * factor;
+	power = color * PI * sceneRadius * sceneRadius * factor;
 	
-	return photon;
+	return Ray(unproject(x, y), orientation);
 }
 
 void DirectionalLight::buildProjectionMap()
@@ -142,13 +135,10 @@ vec3f PointLight::getDirection( const vec3f& P ) const
 	return (position - P).normalize();
 }
 
-Photon* PointLight::emitPhoton() const
+Ray PointLight::emitPhoton(vec3f& power) const
 {
-	auto* photon = new Photon;
-	photon->position = position;
-	photon->direction = uniformSampleSphere().normalize();
-	photon->power = color * PI_4;
-	return photon;
+	power = color * PI_4;
+	return Ray(position, uniformSampleSphere().normalize());
 }
 
 void PointLight::setAttenuationCoeff(double constant, double linear, double quadratic)
@@ -164,11 +154,7 @@ vec3f PointLight::shadowAttenuation(const vec3f& P, double t) const
     // YOUR CODE HERE:
     // You should implement shadow-handling code here.
 
-	Ray r(P, getDirection(P), t);
-	Isect isect;
-	if (scene->bvhIntersect(r, isect))
-		return isect.getMaterial().kt;
-    return vec3f(1,1,1);
+	return scene->transmittance(Ray(P, getDirection(P), t), (position - P).length());
 }
 
 vec3f SpotLight::shadowAttenuation(const vec3f& P, double t) const
@@ -180,12 +166,7 @@ vec3f SpotLight::shadowAttenuation(const vec3f& P, double t) const
 	
 	double attenuation = smoothstep(cosCone, cosPenumbra, cosAngle);
 	
-	Ray r(P, getDirection(P), t);
-	Isect isect;
-	if (scene->bvhIntersect(r, isect))
-		return attenuation * isect.getMaterial().kt;
-	
-    return attenuation * vec3f(1,1,1);
+	return attenuation * scene->transmittance(Ray(P, getDirection(P), t), (position - P).length());
 }
 
 double SpotLight::distanceAttenuation(const vec3f& P) const
@@ -214,23 +195,15 @@ vec3f AreaLight::getDirAndAtten(const vec3f& objPos, vec3f& attenuation, double
 {
 	vec3f lDir = sample() - objPos;
 	double distAtten = scene->lightScale / (lDir.length_squared() + LIGHT_EPSILON);
-	Ray r(objPos, lDir, t);
-	Isect isect;
-	if (scene->bvhIntersect(r, isect))
-		attenuation = isect.getMaterial().kt;
-	else
-		attenuation = vec3f(1.0);
-	attenuation *= distAtten;
+	attenuation = scene->transmittance(Ray(objPos, lDir, t), lDir.length()) * distAtten;
     return lDir.normalize();
 }
 
-Photon* AreaLight::emitPhoton() const
+Ray AreaLight::emitPhoton(vec3f& power) const
 {
-	auto* photon = new Photon;
-	photon->position = sample();
-	photon->direction = localToWorld(cosineSampleHemisphere(), direction);
-	photon->power = color * (PI * area);
-	return photon;
+	power = color * (PI * area);
+	vec3f origin = sample();
+	return Ray(origin, localToWorld(cosineSampleHemisphere(), direction));
 }
 
 vec3f AreaLight::sample() const
@@ -244,13 +217,7 @@ vec3f WarnLight::shadowAttenuation(const vec3f& P, double t) const {
 	if (P[0]<minx || P[0]>maxx) return vec3f();
 	double attenuation = max(pow(con, concentrateP),0.0);
 
-	Ray r(P, getDirection(P), t);
-	Isect isect;
-	if (scene->bvhIntersect(r, isect))
-		return attenuation * isect.getMaterial().kt;
-
-	return attenuation * vec3f(1, 1, 1);
-
+	return attenuation * scene->transmittance(Ray(P, getDirection(P), t), (position - P).length());
 }
 
 double WarnLight::distanceAttenuation(const vec3f& P) const {
@@ -3,7 +3,6 @@
 
 #include "scene.h"
 
-class Photon;
 const double LIGHT_EPSILON = 0.01;
 
 class Light
@@ -15,7 +14,8 @@ public:
 	virtual vec3f getColor( const vec3f& P ) const = 0;
 	virtual vec3f getDirection( const vec3f& P ) const = 0;
 	virtual vec3f getDirAndAtten(const vec3f& objPos, vec3f& attenuation,  double t) const { return vec3f(0.0); }
-	virtual Photon* emitPhoton() const { return nullptr; }
+	// The ray a photon leaves the light along, and its power
+	virtual Ray emitPhoton(vec3f& power) const { power = vec3f(); return Ray(vec3f(), vec3f()); }
 	virtual void buildProjectionMap() { }
 	virtual bool isAreaLight() const { return false; }
 
@@ -47,7 +47,7 @@ public:
 	virtual double distanceAttenuation( const vec3f& P ) const;
 	virtual vec3f getColor( const vec3f& P ) const;
 	virtual vec3f getDirection( const vec3f& P ) const;
-	Photon* emitPhoton() const override;
+	Ray emitPhoton(vec3f& power) const override;
 	void buildProjectionMap() override;
 
 protected:
@@ -71,7 +71,7 @@ public:
 	virtual double distanceAttenuation( const vec3f& P ) const;
 	virtual vec3f getColor( const vec3f& P ) const;
 	virtual vec3f getDirection( const vec3f& P ) const;
-	Photon* emitPhoton() const override;
+	Ray emitPhoton(vec3f& power) const override;
 	void setAttenuationCoeff(double constant, double linear, double quadratic);
 
 protected:
@@ -120,7 +120,7 @@ public:
 	vec3f getColor(const vec3f& P) const override { return color; }
 	vec3f getDirection(const vec3f& P) const override { return (pos - P).normalize(); }
 	bool isAreaLight() const override { return true; }
-	Photon* emitPhoton() const override;
+	Ray emitPhoton(vec3f& power) const override;
 
 protected:
 	vec3f sample() const;
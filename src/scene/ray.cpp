@@ -5,7 +5,30 @@
 const Material &
 Isect::getMaterial() const
 {
-    return material ? *material : obj->getMaterial();
+	if( interpolated )
+		return *material;
+	if( vertexMaterials[0] == nullptr )
+		return obj->getMaterial();
+
+	// linearly interpolate materials
+	if( material == nullptr )
+		material = new Material();
+	else
+		*material = Material();
+	for( int i = 0; i < 3; ++i )
+		*material += bary[i] * (*vertexMaterials[i]);
+	interpolated = true;
+	return *material;
+}
+
+void Isect::setMaterial( const Material& m )
+{
+	vertexMaterials[0] = nullptr;
+	if( material == nullptr )
+		material = new Material( m );
+	else
+		*material = m;
+	interpolated = true;
 }
 
 Ray Ray::reflect(const Isect& isect) const
@@ -25,14 +25,20 @@ public:
 
 class Ray {
 public:
+	Ray() : time(0.0) { sign[0] = sign[1] = sign[2] = 0; }
 	Ray( const vec3f& pp, const vec3f& dd, double time = 0.0, double prevIndex = 1.0 )
-        : p( pp ), d( dd.normalize() ), time(time), prevIndex(prevIndex) {}
+        : p( pp ), d( dd.normalize() ), time(time), prevIndex(prevIndex) { updateInverse(); }
 	Ray( const Ray& other ) 
-		: p( other.p ), d( other.d ), time(other.time), prevIndex(other.prevIndex) {}
+		: p( other.p ), d( other.d ), invD( other.invD ), time(other.time), prevIndex(other.prevIndex)
+	{ sign[0] = other.sign[0]; sign[1] = other.sign[1]; sign[2] = other.sign[2]; }
 	~Ray() {}
 
 	Ray& operator =( const Ray& other ) 
-	{ p = other.p; d = other.d; time = other.time; prevIndex = other.prevIndex; return *this; }
+	{
+		p = other.p; d = other.d; invD = other.invD; time = other.time; prevIndex = other.prevIndex;
+		sign[0] = other.sign[0]; sign[1] = other.sign[1]; sign[2] = other.sign[2];
+		return *this;
+	}
 
 	vec3f at( double t ) const
 	{ return p + (t*d); }
@@ -41,6 +47,13 @@ public:
 	vec3f getDirection() const { return d; }
 	double getTime() const { return time; }
 
+	// Precomputed for slab tests: 1 / direction, and 1 for the negative components
+	const vec3f& getInverseDirection() const { return invD; }
+	const int* getSign() const { return sign; }
+
+	// The same ray from another origin, the direction is kept as it is
+	Ray movedTo( const vec3f& pos ) const { Ray r( *this ); r.p = pos; return r; }
+
 	Ray reflect(const Isect& isect) const;
 	bool refract(const Isect& isect, Ray& out) const;
 	vec3f normalToPoint(const vec3f& point) const;    // return the vector that starts from the point
@@ -50,8 +63,18 @@ public:
 	double prevIndex{1.0};
 
 protected:
+	void updateInverse()
+	{
+		invD = vec3f(1.0 / d[0], 1.0 / d[1], 1.0 / d[2]);
+		sign[0] = invD[0] < 0.0;
+		sign[1] = invD[1] < 0.0;
+		sign[2] = invD[2] < 0.0;
+	}
+
 	vec3f p;
 	vec3f d;
+	vec3f invD;
+	int sign[3];
 	double time;
 };
 
@@ -61,17 +84,28 @@ class Isect
 {
 public:
     Isect()
-        : obj( NULL ), t( 0.0 ), N(), material(0) {}
+        : obj( NULL ), t( 0.0 ), N() {}
 
     ~Isect()
     {
         delete material;
     }
-    
+
     void setObject( SceneObject *o ) { obj = o; }
     void setT( double tt ) { t = tt; }
     void setN( const vec3f& n ) { N = n; }
-    void setMaterial( Material *m ) { delete material; material = m; }
+	// Materials at the corners of the triangle hit, interpolated at bary the
+	// first time getMaterial() is called, so intersection tests don't allocate
+	void setVertexMaterials( const Material* a, const Material* b, const Material* c )
+	{
+		vertexMaterials[0] = a;
+		vertexMaterials[1] = b;
+		vertexMaterials[2] = c;
+		interpolated = false;
+	}
+	// A material of this hit alone, for other objects whose material varies over the surface
+	void setMaterial( const Material& m );
+	void clearMaterial() { vertexMaterials[0] = nullptr; interpolated = false; }
         
     Isect& operator =( const Isect& other )
     {
@@ -80,38 +114,47 @@ public:
             obj = other.obj;
             t = other.t;
             N = other.N;
-//            material = other.material ? new Material( *(other.material) ) : 0;
-			if( other.material )
-            {
-                if( material )
-                    *material = *other.material;
-                else
-                    material = new Material(*other.material );
-            }
-            else
-            {
-                material = 0;
-            }
+			prim = other.prim;
+			bary = other.bary;
+			local = other.local;
+			for( int i = 0; i < 3; ++i )
+				vertexMaterials[i] = other.vertexMaterials[i];
+			interpolated = other.interpolated;		// into its own buffer, which is kept
+			if( interpolated )
+			{
+				if( material )
+					*material = *other.material;
+				else
+					material = new Material( *other.material );
+			}
         		hasTexCoords = other.hasTexCoords;
         		texCoords = other.texCoords;
         		tbn = other.tbn;
         }
         return *this;
     }
+    Isect( const Isect& other ) { *this = other; }
 
 public:
     const SceneObject 	*obj;
     double t;
     vec3f N;
-    Material *material;         // if this intersection has its own material
-                                // (as opposed to one in its associated object)
-                                // as in the case where the material was interpolated
+	// Where on the object the hit is, for the objects that defer the rest to
+	// computeSurfaceInteraction, e.g. the face and barycentric coordinates on a mesh
+	int prim{-1};
+	vec3f bary;
+	bool local{false};		// N and tbn are still in the object's space
 	bool hasTexCoords{false};
 	TexCoords texCoords{0.0, 0.0};
 	mat3f tbn;      // TBN matrix to transform from tangent space to world space
 	
     const Material &getMaterial() const;
     // Other info here.
+
+private:
+	const Material* vertexMaterials[3]{nullptr, nullptr, nullptr};
+	mutable bool interpolated{false};		// material holds the material of the hit
+	mutable Material* material{nullptr};		// allocated the first time it is needed
 };
 
 const double RAY_EPSILON = 0.00001;
@@ -1,6 +1,9 @@
 #include <cmath>
+#include <future>
+#include <thread>
 
 #include "scene.h"
+#include "bvhcache.h"
 #include "light.h"
 #include "../ui/TraceUI.h"
 extern TraceUI* traceUI;
@@ -31,72 +34,200 @@ bool BoundingBox::intersects(const vec3f& point) const
 // if the ray hits the box, put the "t" value of the intersection
 // closest to the origin in tMin and the "t" value of the far intersection
 // in tMax and return true, else return false.
-// Using Kay/Kajiya algorithm.
+// Using Kay/Kajiya algorithm, the precomputed inverse direction and its sign
+// select the near and far slab without branching.
 bool BoundingBox::intersect(const Ray& r, double& tMin, double& tMax) const
 {
-	vec3f R0 = r.getPosition();
-	vec3f Rd = r.getDirection();
+	const vec3f R0 = r.getPosition();
+	const vec3f& invD = r.getInverseDirection();
+	const int* sign = r.getSign();
+	const vec3f* bounds[2] = {&min, &max};
 
 	tMin = -1.0e308; // 1.0e308 is close to infinity... close enough for us!
 	tMax = 1.0e308;
-	double ttemp;
-	
+
 	for (int currentaxis = 0; currentaxis < 3; currentaxis++)
 	{
-		double vd = Rd[currentaxis];
-		
-		// if the ray is parallel to the face's plane (=0.0)
-		if( vd == 0.0 )
-			continue;
+		// two slab intersections, the new value comes first so that the NaN
+		// produced by a ray parallel to and lying on the slab is ignored
+		double t1 = ((*bounds[sign[currentaxis]])[currentaxis] - R0[currentaxis]) * invD[currentaxis];
+		double t2 = ((*bounds[1 - sign[currentaxis]])[currentaxis] - R0[currentaxis]) * invD[currentaxis];
+		tMin = _max(t1, tMin);
+		tMax = _min(t2, tMax);
+	}
+	
+	// box is missed, or behind ray
+	return tMin <= tMax && tMax >= 0.0;
+}
 
-		double v1 = min[currentaxis] - R0[currentaxis];
-		double v2 = max[currentaxis] - R0[currentaxis];
-
-		// two slab intersections
-		double t1 = v1/vd;
-		double t2 = v2/vd;
-		
-		if ( t1 > t2 ) { // swap t1 & t2
-			ttemp = t1;
-			t1 = t2;
-			t2 = ttemp;
-		}
+void BoundingBox::merge(const BoundingBox& target)
+{
+	min = minimum(min, target.min);
+	max = maximum(max, target.max);
+}
 
-		if (t1 > tMin)
-			tMin = t1;
-		if (t2 < tMax)
-			tMax = t2;
+double BoundingBox::area() const
+{
+	vec3f d = max - min;
+	return 2.0 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
 
-		if (tMin > tMax) // box is missed
-			return false;
-		if (tMax < 0.0) // box is behind ray
-			return false;
+BoundingBox BoundingBox::overlap(const BoundingBox& target) const
+{
+	BoundingBox box;
+	box.min = maximum(min, target.min);
+	box.max = minimum(max, target.max);
+	return box;
+}
+
+bool BoundingBox::isEmpty() const
+{
+	return min[0] > max[0] || min[1] > max[1] || min[2] > max[2];
+}
+
+BoundingBox BoundingBox::emptyBox()
+{
+	BoundingBox box;
+	box.min = vec3f(1.0e308, 1.0e308, 1.0e308);
+	box.max = vec3f(-1.0e308, -1.0e308, -1.0e308);
+	return box;
+}
+
+void RayPacket::add(const Ray& ray, double tMax)
+{
+	rays[size] = ray;
+	this->tMax[size] = tMax;
+	++size;
+}
+
+void RayPacket::computeBounds()
+{
+	for (int k = 0; k < 3; ++k)
+	{
+		originLow[k] = originHigh[k] = rays[0].getPosition()[k];
+		// finite, so that a zero distance times the inverse stays zero
+		inverseLow[k] = inverseHigh[k] = _min(_max(rays[0].getInverseDirection()[k], -1.0e30), 1.0e30);
+		coherent[k] = true;
+		for (int i = 1; i < size; ++i)
+		{
+			double origin = rays[i].getPosition()[k];
+			double inverse = _min(_max(rays[i].getInverseDirection()[k], -1.0e30), 1.0e30);
+			originLow[k] = _min(originLow[k], origin);
+			originHigh[k] = _max(originHigh[k], origin);
+			inverseLow[k] = _min(inverseLow[k], inverse);
+			inverseHigh[k] = _max(inverseHigh[k], inverse);
+			coherent[k] = coherent[k] && rays[i].getSign()[k] == rays[0].getSign()[k];
+		}
+	}
+}
+
+// Interval arithmetic on the slab test: on every axis where the directions
+// agree in sign, no ray enters the slab before the lowest entry over the
+// origin and inverse direction ranges, nor leaves it after the highest exit.
+// Axes where they don't agree don't rule anything out.
+bool RayPacket::misses(const FloatBoundingBox& box) const
+{
+	double tNear = 0.0, tFar = 1.0e308;
+	for (int k = 0; k < 3; ++k)
+	{
+		if (!coherent[k])
+			continue;
+		bool negative = rays[0].getSign()[k] != 0;
+		double nearPlane = negative ? box.max[k] : box.min[k];
+		double farPlane = negative ? box.min[k] : box.max[k];
+		double products[4] = {
+			(nearPlane - originLow[k]) * inverseLow[k], (nearPlane - originLow[k]) * inverseHigh[k],
+			(nearPlane - originHigh[k]) * inverseLow[k], (nearPlane - originHigh[k]) * inverseHigh[k]};
+		tNear = _max(tNear, _min(_min(products[0], products[1]), _min(products[2], products[3])));
+		products[0] = (farPlane - originLow[k]) * inverseLow[k];
+		products[1] = (farPlane - originLow[k]) * inverseHigh[k];
+		products[2] = (farPlane - originHigh[k]) * inverseLow[k];
+		products[3] = (farPlane - originHigh[k]) * inverseHigh[k];
+		tFar = _min(tFar, _max(_max(products[0], products[1]), _max(products[2], products[3])));
 	}
-	return true; // it made it past all 3 axes.
+	return tNear > tFar;
 }
 
 
 bool Geometry::intersect(const Ray&r, Isect&i) const
 {
-    // Transform the ray into the object's local coordinate space
-    vec3f pos = transform->globalToLocalCoords(r.getPosition());
-    vec3f dir = transform->globalToLocalCoords(r.getPosition() + r.getDirection()) - pos;
-    double length = dir.length();
-    dir /= length;
+	if (!intersectHit(r, i))
+		return false;
+	i.obj->computeSurfaceInteraction(i);
+	return true;
+}
 
-    Ray localRay( pos, dir );
+bool Geometry::intersectHit(const Ray& r, Isect& i) const
+{
+    // Transform the ray into the object's local coordinate space
+    double length;
+    Ray localRay = transform->globalToLocalRay( r, length );
 
+	i.clearMaterial();	// the isect may be reused from a hit on a mesh
     if (intersectLocal(localRay, i)) {
-        // Transform the intersection point & normal returned back into global space.
-		i.N = transform->localToGlobalCoordsNormal(i.N);
 		i.t /= length;
-    		if (i.hasTexCoords)
-    			i.tbn = transform->normi * i.tbn;
+		i.local = true;
 		return true;
     } else {
         return false;
     }
-    
+}
+
+uint64_t Geometry::intersectHits(RayPacket& packet, uint64_t mask, Isect* isects) const
+{
+	uint64_t hits = 0;
+	Isect cur;
+	for (int i = 0; i < packet.size; ++i)
+	{
+		if ((mask >> i & 1) && intersectHit(packet.rays[i], cur) && cur.t < packet.tMax[i])
+		{
+			packet.tMax[i] = cur.t;
+			isects[i] = cur;
+			hits |= 1ull << i;
+		}
+	}
+	return hits;
+}
+
+// Transform the normal returned by intersectLocal back into global space.
+void Geometry::computeSurfaceInteraction(Isect& i) const
+{
+	if (!i.local)
+		return;
+	i.local = false;
+	computeLocalSurface(i);
+	if (transform->kind == TransformNode::Kind::General)
+	{
+		i.N = transform->localToGlobalCoordsNormal(i.N);
+		if (i.hasTexCoords)
+			i.tbn = transform->normi * i.tbn;
+		return;
+	}
+	// normi is the identity times invScale
+	i.N = i.N.normalize();
+	if (i.hasTexCoords && transform->kind == TransformNode::Kind::UniformScale)
+		i.tbn = i.tbn * transform->invScale;
+}
+
+void TransformNode::classify()
+{
+	inverseLinear = inverse.upper33();
+	offset = vec3f(xform[0][3], xform[1][3], xform[2][3]);
+	mat3f linear = xform.upper33();
+	bool diagonal = xform[3] == vec4f(0.0, 0.0, 0.0, 1.0);
+	for (int j = 0; j < 3; ++j)
+		for (int k = 0; k < 3; ++k)
+			diagonal = diagonal && (j == k || linear[j][k] == 0.0);
+	double scale = linear[0][0];
+	if (!diagonal || scale <= 0.0 || linear[1][1] != scale || linear[2][2] != scale)
+		kind = Kind::General;
+	else if (scale != 1.0)
+	{
+		kind = Kind::UniformScale;
+		invScale = 1.0 / scale;
+	}
+	else
+		kind = offset.iszero() ? Kind::Identity : Kind::Translation;
 }
 
 bool Geometry::intersectLocal( const Ray& r, Isect& i ) const
@@ -155,7 +286,7 @@ bool Scene::intersect( const Ray& r, Isect& i ) const
 
 	// try the non-bounded objects
 	for( j = nonboundedobjects.begin(); j != nonboundedobjects.end(); ++j ) {
-		if( (*j)->intersect( r, cur ) ) {
+		if( (*j)->intersectHit( r, cur ) ) {
 			if( !have_one || (cur.t < i.t) ) {
 				i = cur;
 				have_one = true;
@@ -165,7 +296,7 @@ bool Scene::intersect( const Ray& r, Isect& i ) const
 
 	// try the bounded objects
 	for( j = boundedobjects.begin(); j != boundedobjects.end(); ++j ) {
-		if( (*j)->intersect( r, cur ) ) {
+		if( (*j)->intersectHit( r, cur ) ) {
 			if( !have_one || (cur.t < i.t) ) {
 				i = cur;
 				have_one = true;
@@ -173,6 +304,8 @@ bool Scene::intersect( const Ray& r, Isect& i ) const
 		}
 	}
 
+	if( have_one )
+		i.obj->computeSurfaceInteraction( i );
 
 	return have_one;
 }
@@ -184,7 +317,7 @@ bool Scene::bvhIntersect(const Ray& ray, Isect& isect) const
 
 	for (auto* object : nonboundedobjects)
 	{
-		if (object->intersect(ray, curIsect))
+		if (object->intersectHit(ray, curIsect))
 		{
 			if (!flag || curIsect.t < isect.t)
 			{
@@ -194,16 +327,73 @@ bool Scene::bvhIntersect(const Ray& ray, Isect& isect) const
 		}
 	}
 	
+	if (flag)
+		isect.obj->computeSurfaceInteraction(isect);
 	return flag;
 }
 
+uint64_t Scene::bvhIntersect(RayPacket& packet, Isect* isects) const
+{
+	uint64_t hits = bvh.intersect(packet, isects);
+	for (auto* object : nonboundedobjects)
+		hits |= object->intersectHits(packet, packet.allRays(), isects);
+
+	for (int i = 0; i < packet.size; ++i)
+	{
+		if (hits >> i & 1)
+			isects[i].obj->computeSurfaceInteraction(isects[i]);
+	}
+	return hits;
+}
+
+bool Scene::occluded(const Ray& ray, double tMax) const
+{
+	auto blocks = [&](Geometry* object)
+	{
+		Isect isect;
+		return object->intersectHit(ray, isect) && isect.t < tMax;
+	};
+
+	if (bvh.visit(ray, tMax, blocks))
+		return true;
+	for (auto* object : nonboundedobjects)
+		if (blocks(object))
+			return true;
+	return false;
+}
+
+// Stops at the first opaque blocker, transparent ones filter the light by their kt
+vec3f Scene::transmittance(const Ray& ray, double tMax) const
+{
+	vec3f atten(1.0, 1.0, 1.0);
+	auto blocks = [&](Geometry* object)
+	{
+		Isect isect;	// fresh for every object, the material may be interpolated
+		if (!object->intersectHit(ray, isect) || isect.t >= tMax)
+			return false;
+		isect.obj->computeSurfaceInteraction(isect);
+		atten = prod(atten, isect.getMaterial().kt);
+		return atten.iszero();
+	};
+
+	if (bvh.visit(ray, tMax, blocks))
+		return vec3f();
+	for (auto* object : nonboundedobjects)
+		if (blocks(object))
+			return vec3f();
+	return atten;
+}
 
-void Scene::initScene()
+void Scene::initScene(BVHCache* cache)
 {
 	bool first_boundedobject = true;
 	BoundingBox b;
 	
 	typedef list<Geometry*>::const_iterator iter;
+	for (auto* object : objects)
+		object->buildBVH(cache);
+
+
 	// split the objects into two categories: bounded and non-bounded
 	for( iter j = objects.begin(); j != objects.end(); ++j ) {
 		if( (*j)->hasBoundingBoxCapability() )
@@ -229,7 +419,37 @@ void Scene::initScene()
 			emittingObjects.push_back(*j);
 	}
 
+	buildBVH(cache);
+}
+
+void Scene::buildBVH(BVHCache* cache)
+{
+	bvh.shutterOpen = camera.getShutterOpen();
+	bvh.shutterClose = camera.getShutterClose();
+	bvh.cache = cache;
 	bvh.build(boundedobjects);
+	bvh.cache = nullptr;
+}
+
+void Scene::setBVHSplitMethod(BVH::SplitMethod method)
+{
+	bvh.splitMethod = method;
+	for (auto* object : objects)
+		object->setBVHSplitMethod(method);
+}
+
+void Scene::setBVHThreads(int numThreads)
+{
+	bvh.numThreads = numThreads;
+	for (auto* object : objects)
+		object->setBVHThreads(numThreads);
+}
+
+void Scene::refitBVH()
+{
+	bvh.refit();
+	if (!bvh.nodes.empty())
+		sceneBounds = bvh.nodes[0].aabb;
 }
 
 Ray Scene::uniformSampleOneLight(vec3f& emit, double& pdf)
@@ -308,28 +528,509 @@ double HFmap::getH(int x, int y) const {
 	return (static_cast<double>(color[0]) + color[1] + color[2]) / 3.0;
 }
 
-void BVH::build(const list<Geometry*>& objects)
+void BVH::build(const vector<BoundingBox>& boxes)
+{
+	build(boxes, ClipFunc());
+}
+
+void BVH::build(const vector<BoundingBox>& boxes, const ClipFunc& clip)
 {
 	delete root;
+	root = nullptr;
+	nodes.clear();
+	wideNodes.clear();
+	motionBounds.clear();
+	order.clear();
+	if (boxes.empty())
+		return;
+
+	if (cache != nullptr && cache->load(*this, boxes))
+	{
+#ifdef BVH_SIMD
+		if (wide)
+			collapse(0);
+#endif
+		return;
+	}
+
 	root = new BVHNode;
+	if (splitMethod == SplitMethod::SBVH && clip)
+	{
+		// the leaves append their references to order as they are built
+		vector<Reference> refs(boxes.size());
+		BoundingBox bounds = boxes[0];
+		for (int i = 0; i < int(boxes.size()); ++i)
+		{
+			refs[i] = Reference{i, boxes[i]};
+			bounds.merge(boxes[i]);
+		}
+		spatialRootArea = bounds.area();
+		numReferences = boxes.size();
+		maxReferences = int(boxes.size() * (1.0 + maxDuplication));
+		order.reserve(maxReferences);
+		buildSpatial(root, refs, 0, clip);
+	}
+	else
+	{
+		order.resize(boxes.size());
+		beginBuild(boxes);
+		if (splitMethod == SplitMethod::Median)
+			buildHelper(root, 0, boxes.size(), 0, maxSpawnDepth());
+		else
+			buildSAH(root, 0, boxes.size(), 0, maxSpawnDepth());
+		endBuild();
+	}
+
+	// the leaves already cover order in depth-first order
+	flatten(root);
+	delete root;
+	root = nullptr;
+
+	double rootArea = nodes[0].aabb.area();
+	for (auto& node : nodes)
+		node.relArea = rootArea > 0.0 ? float(node.aabb.area() / rootArea) : 1.0f;
+	if (cache != nullptr)
+		cache->store(*this, boxes);
+#ifdef BVH_SIMD
+	if (wide)
+		collapse(0);
+#endif
+}
+
+void BVH::beginBuild(const vector<BoundingBox>& boxes)
+{
+	primBoxes = &boxes;
+	centroids.resize(boxes.size());
+	for (int i = 0; i < int(boxes.size()); ++i)
+	{
+		order[i] = i;
+		centroids[i] = (boxes[i].min + boxes[i].max) / 2.0;
+	}
+}
+
+void BVH::endBuild()
+{
+	primBoxes = nullptr;
+	centroids = vector<vec3f>();
+}
+
+int BVH::threadCount() const
+{
+	if (numThreads > 0)
+		return numThreads;
+	return _max(int(std::thread::hardware_concurrency()), 1);
+}
+
+// Spawn a thread for each subtree in the top levels, a few more than there
+// are threads since the subtrees are unbalanced
+int BVH::maxSpawnDepth() const
+{
+	int threads = threadCount();
+	if (threads == 1)
+		return 0;
+	int depth = 2;
+	while ((1 << depth) < threads * 4)
+		++depth;
+	return depth;
+}
+
+void BVH::build(const list<Geometry*>& objects)
+{
 	vector<Geometry*> objs{std::begin(objects), std::end(objects)};
-	buildHelper(root, objs);
+	vector<BoundingBox> boxes;
+	boxes.reserve(objs.size());
+	for (auto* object : objs)
+		boxes.push_back(object->getBoundingBox());
+	build(boxes);
+
+	this->objects.resize(order.size());
+	for (size_t i = 0; i < order.size(); ++i)
+		this->objects[i] = objs[order[i]];
+	updateObjectMotion();
+}
+
+// Give the nodes interpolated bounds if any object moves during the shutter
+void BVH::updateObjectMotion()
+{
+	vector<MotionBounds> motion(objects.size());
+	bool moving = false;
+	for (size_t i = 0; i < objects.size(); ++i)
+	{
+		if (objects[i]->getMotionBounds(shutterOpen, shutterClose, motion[i]))
+			moving = true;
+		else
+		{
+			motion[i].open = objects[i]->getBoundingBox();
+			motion[i].close = objects[i]->getBoundingBox();
+		}
+	}
+	if (moving)
+		setMotion(motion);
+}
+
+void BVH::setMotion(const vector<MotionBounds>& prims)
+{
+	motionBounds.resize(nodes.size());
+	for (int i = nodes.size() - 1; i >= 0; --i)
+	{
+		const LinearBVHNode& node = nodes[i];
+		MotionBounds& motion = motionBounds[i];
+		if (node.count > 0)
+		{
+			motion = prims[node.offset];
+			for (int j = 1; j < node.count; ++j)
+				motion.merge(prims[node.offset + j]);
+		}
+		else
+		{
+			motion = motionBounds[i + 1];
+			motion.merge(motionBounds[node.offset]);
+		}
+	}
+	// the wide nodes only have the bounds over the whole motion
+	wideNodes.clear();
+}
+
+bool BVH::refit(const vector<BoundingBox>& boxes)
+{
+	order.clear();
+	motionBounds.clear();
+	if (nodes.empty())
+		return false;
+
+	// children always come after their parent in the array
+	for (int i = nodes.size() - 1; i >= 0; --i)
+	{
+		LinearBVHNode& node = nodes[i];
+		BoundingBox box;
+		if (node.count > 0)
+		{
+			box = boxes[node.offset];
+			for (int j = 1; j < node.count; ++j)
+				box.merge(boxes[node.offset + j]);
+		}
+		else
+		{
+			box = nodes[i + 1].aabb;
+			box.merge(nodes[node.offset].aabb);
+		}
+		node.aabb = box;
+	}
+
+	// find the topmost subtrees that degraded too much
+	double rootArea = nodes[0].aabb.area();
+	vector<bool> degraded(nodes.size(), false);
+	bool anyDegraded = false;
+	if (rootArea > 0.0)
+	{
+		int stack[stackSize];
+		int top = 0;
+		stack[top++] = 0;
+		while (top > 0)
+		{
+			int index = stack[--top];
+			const LinearBVHNode& node = nodes[index];
+			if (node.count > 0)
+				continue;
+			if (node.aabb.area() > rebuildRatio * node.relArea * rootArea)
+				degraded[index] = anyDegraded = true;
+			else
+			{
+				assert(top + 2 <= stackSize);
+				stack[top++] = node.offset;
+				stack[top++] = index + 1;
+			}
+		}
+	}
+
+	if (anyDegraded)
+	{
+		order.resize(boxes.size());
+		beginBuild(boxes);
+		vector<LinearBVHNode> old;
+		old.swap(nodes);
+		nodes.reserve(old.size());
+		rebuild(old, 0, 0, degraded, rootArea);
+		endBuild();
+	}
+
+	wideNodes.clear();
+#ifdef BVH_SIMD
+	if (wide)
+		collapse(0);
+#endif
+	return !order.empty();
+}
+
+void BVH::refit()
+{
+	vector<BoundingBox> boxes;
+	boxes.reserve(objects.size());
+	for (auto* object : objects)
+		boxes.push_back(object->getBoundingBox());
+	if (refit(boxes))
+	{
+		vector<Geometry*> reordered(objects.size());
+		for (size_t i = 0; i < objects.size(); ++i)
+			reordered[i] = objects[order[i]];
+		objects.swap(reordered);
+	}
+	updateObjectMotion();
+}
+
+// Append the subtree at index of the old node array to nodes, building the
+// degraded subtrees again over their leaf slots.  Returns its new index.
+int BVH::rebuild(const vector<LinearBVHNode>& old, int index, int depth, const vector<bool>& degraded, double rootArea)
+{
+	int at = nodes.size();
+	if (!degraded[index])
+	{
+		nodes.push_back(old[index]);
+		if (old[index].count > 0)
+			return at;
+		rebuild(old, index + 1, depth + 1, degraded, rootArea);
+		int second = rebuild(old, old[index].offset, depth + 1, degraded, rootArea);	// may reallocate the array
+		nodes[at].offset = second;
+		return at;
+	}
+
+	// the leaves of the subtree cover the slots [first, last)
+	int leftmost = index, rightmost = index;
+	while (old[leftmost].count == 0)
+		++leftmost;
+	while (old[rightmost].count == 0)
+		rightmost = old[rightmost].offset;
+	int first = old[leftmost].offset;
+	int last = old[rightmost].offset + old[rightmost].count;
+
+	BVHNode* subtree = new BVHNode;
+	if (splitMethod == SplitMethod::Median)
+		buildHelper(subtree, first, last, depth, maxSpawnDepth());
+	else
+		buildSAH(subtree, first, last, depth, maxSpawnDepth());
+	flatten(subtree);
+	delete subtree;
+	for (size_t i = at; i < nodes.size(); ++i)
+		nodes[i].relArea = float(nodes[i].aabb.area() / rootArea);
+	return at;
+}
+
+// Append the subtree to the node array in depth-first order, return its index
+int BVH::flatten(const BVHNode* cur)
+{
+	int index = nodes.size();
+	nodes.push_back(LinearBVHNode{cur->aabb, cur->first, cur->count, cur->axis, 0.0f});
+	if (cur->left == nullptr)
+		return index;
+	flatten(cur->left);
+	int second = flatten(cur->right);	// may reallocate the array
+	nodes[index].offset = second;
+	return index;
+}
+
+BoundingBox MotionBounds::at(double s) const
+{
+	BoundingBox box;
+	box.min = (1.0 - s) * open.min + s * close.min;
+	box.max = (1.0 - s) * open.max + s * close.max;
+	return box;
+}
+
+void MotionBounds::merge(const MotionBounds& target)
+{
+	open.merge(target.open);
+	close.merge(target.close);
+}
+
+// Round to float without shrinking the box
+static float roundDown(double x)
+{
+	float f = float(x);
+	return f > x ? nextafterf(f, -FLT_MAX) : f;
+}
+
+static float roundUp(double x)
+{
+	float f = float(x);
+	return f < x ? nextafterf(f, FLT_MAX) : f;
+}
+
+static float clampToFloat(double x)
+{
+	return float(x > FLT_MAX ? FLT_MAX : x < -FLT_MAX ? -FLT_MAX : x);
+}
+
+FloatRay::FloatRay(const Ray& ray)
+{
+	vec3f P = ray.getPosition();
+	const vec3f& invD = ray.getInverseDirection();
+	for (int k = 0; k < 3; ++k)
+	{
+		origin[k] = clampToFloat(P[k]);
+		inverse[k] = clampToFloat(invD[k]);
+		sign[k] = ray.getSign()[k];
+	}
+}
+
+FloatBoundingBox::FloatBoundingBox(const BoundingBox& box)
+{
+	for (int k = 0; k < 3; ++k)
+	{
+		min[k] = roundDown(box.min[k]);
+		max[k] = roundUp(box.max[k]);
+	}
 }
 
-void BVH::buildHelper(BVHNode* cur, const vector<Geometry*>& objects)
+FloatBoundingBox::operator BoundingBox() const
 {
-	BoundingBox maxBoundingBox = calMaxBoundingBox(objects);
+	BoundingBox box;
+	box.min = min;
+	box.max = max;
+	return box;
+}
+
+double FloatBoundingBox::area() const
+{
+	return BoundingBox(*this).area();
+}
+
+void WideBVHNode::setChild(int slot, const BoundingBox& box, int index, int count)
+{
+	for (int k = 0; k < 3; ++k)
+	{
+		min[k][slot] = roundDown(box.min[k]);
+		max[k][slot] = roundUp(box.max[k]);
+	}
+	child[slot] = index;
+	this->count[slot] = count;
+}
+
+void WideBVHNode::clearChild(int slot)
+{
+	for (int k = 0; k < 3; ++k)
+	{
+		min[k][slot] = FLT_MAX;
+		max[k][slot] = -FLT_MAX;
+	}
+	// a NaN ray passes every slab test, so traversal checks this as well
+	child[slot] = -1;
+	count[slot] = 0;
+}
+
+// Pull the grandchildren with the largest boxes up into the node until it
+// has four children, return the index of the wide node
+int BVH::collapse(int index)
+{
+	int children[WideBVHNode::width];
+	int n = 0;
+	if (nodes[index].count > 0)		// a single leaf at the root
+		children[n++] = index;
+	else
+	{
+		children[n++] = index + 1;
+		children[n++] = nodes[index].offset;
+	}
+	while (n < WideBVHNode::width)
+	{
+		int best = -1;
+		double bestArea = -1.0;
+		for (int i = 0; i < n; ++i)
+		{
+			const LinearBVHNode& node = nodes[children[i]];
+			if (node.count == 0 && node.aabb.area() > bestArea)
+			{
+				best = i;
+				bestArea = node.aabb.area();
+			}
+		}
+		if (best < 0)
+			break;
+		int split = children[best];
+		children[best] = split + 1;
+		children[n++] = nodes[split].offset;
+	}
+
+	int wideIndex = wideNodes.size();
+	wideNodes.emplace_back();
+	for (int i = 0; i < WideBVHNode::width; ++i)
+	{
+		if (i >= n)
+		{
+			wideNodes[wideIndex].clearChild(i);
+			continue;
+		}
+		const LinearBVHNode& node = nodes[children[i]];
+		int child = node.count > 0 ? node.offset : collapse(children[i]);	// may reallocate wideNodes
+		wideNodes[wideIndex].setChild(i, node.aabb, child, node.count);
+	}
+	return wideIndex;
+}
+
+// Run func(first, last, chunk) over numChunks slices of [first, last), all but
+// the first one on other threads
+template <class Func>
+static void parallelChunks(int first, int last, int numChunks, Func func)
+{
+	int size = (last - first + numChunks - 1) / numChunks;
+	vector<std::future<void>> tasks;
+	for (int chunk = 1; chunk < numChunks; ++chunk)
+	{
+		int begin = first + chunk * size, end = _min(last, begin + size);
+		if (begin < end)
+			tasks.push_back(std::async(std::launch::async, func, begin, end, chunk));
+	}
+	func(first, _min(last, first + size), 0);
+	for (auto& task : tasks)
+		task.get();
+}
+
+// Depth of a balanced binary tree over n leaves
+static int balancedDepth(int n)
+{
+	int depth = 0;
+	while ((1ll << depth) < n)
+		++depth;
+	return depth;
+}
+
+static int longestAxis(const BoundingBox& box)
+{
+	vec3f extent = box.max - box.min;
+	if (extent[0] >= extent[1] && extent[0] >= extent[2])
+		return 0;
+	return extent[1] >= extent[2] ? 1 : 2;
+}
+
+// Build both children of cur, the left one on another thread for big nodes
+template <class Build>
+static void buildChildren(int n, int threshold, int spawnDepth, Build build)
+{
+	if (spawnDepth > 0 && n >= threshold)
+	{
+		auto left = std::async(std::launch::async, build, true, spawnDepth - 1);
+		build(false, spawnDepth - 1);
+		left.get();
+	}
+	else
+	{
+		build(true, 0);
+		build(false, 0);
+	}
+}
+
+void BVH::buildHelper(BVHNode* cur, int first, int last, int depth, int spawnDepth)
+{
+	BoundingBox centroidBounds;
+	BoundingBox maxBoundingBox = calMaxBoundingBox(first, last, centroidBounds);
 	cur->aabb = maxBoundingBox;
 	
-	if (objects.size() < threshold)
+	if (last - first < threshold || depth >= maxDepth)
 	{
-		cur->objects = objects;
+		cur->first = first;
+		cur->count = last - first;
 		return;
 	}
 	
-	vector<Geometry*> left, right;
-	vector<pair<Geometry*, double>> coords;
-	
 	double xRange = maxBoundingBox.max[0] - maxBoundingBox.min[0];
 	double yRange = maxBoundingBox.max[1] - maxBoundingBox.min[1];
 	double zRange = maxBoundingBox.max[2] - maxBoundingBox.min[2];
@@ -340,88 +1041,536 @@ void BVH::buildHelper(BVHNode* cur, const vector<Geometry*>& objects)
 		axis = 1;
 	if (zRange > xRange && zRange > yRange)
 		axis = 2;
-	
-	for (auto* object : objects)
-	{
-		BoundingBox curBox = object->getBoundingBox();
-		coords.emplace_back(object, (curBox.max[axis] + curBox.min[axis]) / 2.0);
-	}
 
-	sort(coords.begin(), coords.end(), 
-		[](const pair<Geometry*, double>& a, const pair<Geometry*, double>& b) { return a.second < b.second; }
+	// only the median has to be in place, not the whole range sorted
+	int mid = first + (last - first) / 2;
+	nth_element(order.begin() + first, order.begin() + mid, order.begin() + last, 
+		[this, axis](int a, int b) { return centroids[a][axis] < centroids[b][axis]; }
 	);
 
-	int mid = coords.size() / 2;
-	for (int i = 0; i < mid; ++i)
-		left.push_back(coords[i].first);
-	for (int i = mid; i < coords.size(); ++i)
-		right.push_back(coords[i].first);
-
+	cur->axis = axis;
 	cur->left = new BVHNode;
 	cur->right = new BVHNode;
 
-	buildHelper(cur->left, left);
-	buildHelper(cur->right, right);
+	buildChildren(last - first, parallelThreshold, spawnDepth, [=](bool left, int spawn)
+	{
+		if (left)
+			buildHelper(cur->left, first, mid, depth + 1, spawn);
+		else
+			buildHelper(cur->right, mid, last, depth + 1, spawn);
+	});
 }
 
-BoundingBox BVH::calMaxBoundingBox(const vector<Geometry*>& objects)
+struct SAHBin
 {
+	int count{0};
 	BoundingBox aabb;
-	if (objects.empty())
-		return aabb;
-	vec3f curMin = objects[0]->getBoundingBox().min, curMax = objects[0]->getBoundingBox().max;
-	for (auto* object : objects)
+
+	void add(const BoundingBox& box)
+	{
+		if (count++ == 0)
+			aabb = box;
+		else
+			aabb.merge(box);
+	}
+	void add(const SAHBin& bin)
 	{
-		curMin = minimum(curMin, object->getBoundingBox().min);
-		curMax = maximum(curMax, object->getBoundingBox().max);
+		if (bin.count == 0)
+			return;
+		if (count == 0)
+			aabb = bin.aabb;
+		else
+			aabb.merge(bin.aabb);
+		count += bin.count;
 	}
-	
-	aabb.max = curMax;
-	aabb.min = curMin;
-	return aabb;
-}
+};
 
-bool BVH::intersect(const Ray& ray, Isect& isect) const
+// Binned SAH: the centroids are projected into numBins buckets along each axis
+// and the cheapest bucket boundary is chosen as the split plane.  Binning of
+// big nodes is split over several threads.
+void BVH::buildSAH(BVHNode* cur, int first, int last, int depth, int spawnDepth)
 {
-	return root->intersect(ray, isect);
+	int n = last - first;
+	BoundingBox centroidBounds;
+	cur->aabb = calMaxBoundingBox(first, last, centroidBounds);
+
+	if (n == 1)
+	{
+		cur->first = first;
+		cur->count = n;
+		return;
+	}
+
+	// Near the depth limit only a balanced split is sure to fit the rest of
+	// the subtree in, so fall back to the object median there
+	if (depth + balancedDepth(n) >= maxDepth)
+	{
+		if (n <= maxLeafSize)
+		{
+			cur->first = first;
+			cur->count = n;
+			return;
+		}
+		int axis = longestAxis(centroidBounds);
+		int mid = first + n / 2;
+		nth_element(order.begin() + first, order.begin() + mid, order.begin() + last,
+			[this, axis](int a, int b) { return centroids[a][axis] < centroids[b][axis]; });
+		cur->axis = axis;
+		cur->left = new BVHNode;
+		cur->right = new BVHNode;
+		buildChildren(n, parallelThreshold, spawnDepth, [=](bool left, int spawn)
+		{
+			if (left)
+				buildSAH(cur->left, first, mid, depth + 1, spawn);
+			else
+				buildSAH(cur->right, mid, last, depth + 1, spawn);
+		});
+		return;
+	}
+
+	const vector<BoundingBox>& boxes = *primBoxes;
+	vec3f scale;
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		double extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+		scale[axis] = extent > 0.0 ? numBins / extent : 0.0;
+	}
+
+	// Bin all three axes in one pass
+	SAHBin bins[3][numBins];
+	auto binRange = [&](int begin, int end, SAHBin (*dest)[numBins])
+	{
+		for (int i = begin; i < end; ++i)
+		{
+			int prim = order[i];
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				int b = int((centroids[prim][axis] - centroidBounds.min[axis]) * scale[axis]);
+				if (b >= numBins)
+					b = numBins - 1;
+				dest[axis][b].add(boxes[prim]);
+			}
+		}
+	};
+	int numChunks = n >= parallelThreshold * 4 ? threadCount() : 1;
+	if (numChunks > 1)
+	{
+		struct ChunkBins { SAHBin bins[3][numBins]; };
+		vector<ChunkBins> chunkBins(numChunks);
+		parallelChunks(first, last, numChunks, [&](int begin, int end, int chunk)
+		{
+			binRange(begin, end, chunkBins[chunk].bins);
+		});
+		for (const auto& chunk : chunkBins)
+			for (int axis = 0; axis < 3; ++axis)
+				for (int b = 0; b < numBins; ++b)
+					bins[axis][b].add(chunk.bins[axis][b]);
+	}
+	else
+		binRange(first, last, bins);
+
+	double nodeArea = cur->aabb.area();
+	double bestCost = 1.0e308;
+	int bestAxis = -1, bestBin = -1;
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		if (scale[axis] == 0.0)
+			continue;
+
+		// Sweep from the right to get the area and count of every suffix
+		double rightArea[numBins];
+		int rightCount[numBins];
+		SAHBin acc;
+		for (int i = numBins - 1; i > 0; --i)
+		{
+			acc.add(bins[axis][i]);
+			rightArea[i] = acc.count > 0 ? acc.aabb.area() : 0.0;
+			rightCount[i] = acc.count;
+		}
+
+		// Then sweep from the left and evaluate the split after every bin
+		acc = SAHBin();
+		for (int i = 0; i < numBins - 1; ++i)
+		{
+			acc.add(bins[axis][i]);
+			if (acc.count == 0 || rightCount[i + 1] == 0)
+				continue;
+			double cost = traversalCost + intersectCost *
+				(acc.count * acc.aabb.area() + rightCount[i + 1] * rightArea[i + 1]) / nodeArea;
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestBin = i;
+			}
+		}
+	}
+
+	// All centroids coincide, or splitting does not pay off
+	double leafCost = intersectCost * n;
+	if (bestAxis == -1 || (n <= maxLeafSize && leafCost <= bestCost))
+	{
+		cur->first = first;
+		cur->count = n;
+		return;
+	}
+
+	double minC = centroidBounds.min[bestAxis];
+	double axisScale = scale[bestAxis];
+	int mid = partition(order.begin() + first, order.begin() + last, [&](int prim)
+	{
+		int b = int((centroids[prim][bestAxis] - minC) * axisScale);
+		if (b >= numBins)
+			b = numBins - 1;
+		return b <= bestBin;
+	}) - order.begin();
+
+	cur->axis = bestAxis;
+	cur->left = new BVHNode;
+	cur->right = new BVHNode;
+
+	buildChildren(n, parallelThreshold, spawnDepth, [=](bool left, int spawn)
+	{
+		if (left)
+			buildSAH(cur->left, first, mid, depth + 1, spawn);
+		else
+			buildSAH(cur->right, mid, last, depth + 1, spawn);
+	});
 }
 
-bool BVHNode::intersect(const Ray& ray, Isect& isect) const
+// SBVH (Stich et al. 2009): besides the binned object split, nodes whose
+// object split children overlap a lot also try splitting space into numBins
+// slabs.  References straddling the chosen plane are clipped into both
+// children, unless keeping them whole on one side is cheaper or the
+// duplication budget is used up.
+void BVH::buildSpatial(BVHNode* cur, vector<Reference>& refs, int depth, const ClipFunc& clip)
 {
-	double tMin, tMax;
-	if (!aabb.intersect(ray, tMin, tMax))
-		return false;
+	int n = refs.size();
+	BoundingBox centroidBounds;
+	cur->aabb = refs[0].box;
+	centroidBounds.min = centroidBounds.max = (refs[0].box.min + refs[0].box.max) / 2.0;
+	for (const auto& ref : refs)
+	{
+		vec3f centroid = (ref.box.min + ref.box.max) / 2.0;
+		cur->aabb.merge(ref.box);
+		centroidBounds.min = minimum(centroidBounds.min, centroid);
+		centroidBounds.max = maximum(centroidBounds.max, centroid);
+	}
 
-	if (left == nullptr)		// leaf node
+	auto makeLeaf = [&]()
 	{
-		bool flag = false;
-		Isect curIsect;
-		for (auto* object : objects)
+		cur->first = order.size();
+		cur->count = n;
+		for (const auto& ref : refs)
+			order.push_back(ref.prim);
+	};
+	if (n == 1)
+	{
+		makeLeaf();
+		return;
+	}
+
+	// Median split near the depth limit as in buildSAH, it never duplicates
+	if (depth + balancedDepth(n) >= maxDepth)
+	{
+		if (n <= maxLeafSize)
+		{
+			makeLeaf();
+			return;
+		}
+		int axis = longestAxis(centroidBounds);
+		auto mid = refs.begin() + n / 2;
+		nth_element(refs.begin(), mid, refs.end(), [axis](const Reference& a, const Reference& b)
+		{
+			return a.box.min[axis] + a.box.max[axis] < b.box.min[axis] + b.box.max[axis];
+		});
+		vector<Reference> left(refs.begin(), mid), right(mid, refs.end());
+		refs = vector<Reference>();
+		cur->axis = axis;
+		cur->left = new BVHNode;
+		cur->right = new BVHNode;
+		buildSpatial(cur->left, left, depth + 1, clip);
+		left = vector<Reference>();
+		buildSpatial(cur->right, right, depth + 1, clip);
+		return;
+	}
+
+	// Object split, binned on the centroids like buildSAH
+	double nodeArea = cur->aabb.area();
+	vec3f scale;
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		double extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+		scale[axis] = extent > 0.0 ? numBins / extent : 0.0;
+	}
+	auto objectBin = [&](const Reference& ref, int axis)
+	{
+		double centroid = (ref.box.min[axis] + ref.box.max[axis]) / 2.0;
+		int b = int((centroid - centroidBounds.min[axis]) * scale[axis]);
+		return b >= numBins ? numBins - 1 : b;
+	};
+	SAHBin bins[3][numBins];
+	for (const auto& ref : refs)
+		for (int axis = 0; axis < 3; ++axis)
+			bins[axis][objectBin(ref, axis)].add(ref.box);
+
+	double bestCost = 1.0e308;
+	int bestAxis = -1, bestBin = -1;
+	BoundingBox bestLeft, bestRight;
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		if (scale[axis] == 0.0)
+			continue;
+		SAHBin right[numBins];
+		for (int i = numBins - 1; i > 0; --i)
 		{
-			if (object->intersect(ray, curIsect))
+			right[i] = i + 1 < numBins ? right[i + 1] : SAHBin();
+			right[i].add(bins[axis][i]);
+		}
+		SAHBin left;
+		for (int i = 0; i < numBins - 1; ++i)
+		{
+			left.add(bins[axis][i]);
+			if (left.count == 0 || right[i + 1].count == 0)
+				continue;
+			double cost = traversalCost + intersectCost *
+				(left.count * left.aabb.area() + right[i + 1].count * right[i + 1].aabb.area()) / nodeArea;
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestBin = i;
+				bestLeft = left.aabb;
+				bestRight = right[i + 1].aabb;
+			}
+		}
+	}
+
+	// Spatial split, only worth it where the object split children overlap
+	bool spatial = false;
+	double splitPos = 0.0;
+	int leftCount = 0, rightCount = 0;
+	BoundingBox overlap = bestLeft.overlap(bestRight);
+	if (numReferences < maxReferences &&
+		(bestAxis == -1 || (!overlap.isEmpty() && overlap.area() > spatialSplitAlpha * spatialRootArea)))
+	{
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			double origin = cur->aabb.min[axis];
+			double binWidth = (cur->aabb.max[axis] - origin) / numBins;
+			if (binWidth <= 0.0)
+				continue;
+			auto spatialBin = [&](double x)
+			{
+				int b = int((x - origin) / binWidth);
+				return b < 0 ? 0 : b >= numBins ? numBins - 1 : b;
+			};
+
+			// chop every reference into the bins it spans
+			SAHBin chopped[numBins];
+			int enters[numBins] = {0}, exits[numBins] = {0};
+			for (const auto& ref : refs)
+			{
+				int first = spatialBin(ref.box.min[axis]), last = spatialBin(ref.box.max[axis]);
+				BoundingBox rest = ref.box, left, right;
+				for (int b = first; b < last && !rest.isEmpty(); ++b)
+				{
+					clip(ref.prim, rest, axis, origin + (b + 1) * binWidth, left, right);
+					if (!left.isEmpty())
+						chopped[b].add(left);
+					rest = right;
+				}
+				if (!rest.isEmpty())
+					chopped[last].add(rest);
+				++enters[first];
+				++exits[last];
+			}
+
+			SAHBin right[numBins];
+			int rightRefs[numBins];
+			for (int i = numBins - 1; i > 0; --i)
+			{
+				right[i] = i + 1 < numBins ? right[i + 1] : SAHBin();
+				right[i].add(chopped[i]);
+				rightRefs[i] = (i + 1 < numBins ? rightRefs[i + 1] : 0) + exits[i];
+			}
+			SAHBin left;
+			int leftRefs = 0;
+			for (int i = 0; i < numBins - 1; ++i)
 			{
-				if (!flag || curIsect.t < isect.t)
+				left.add(chopped[i]);
+				leftRefs += enters[i];
+				if (left.count == 0 || right[i + 1].count == 0 || leftRefs == 0 || rightRefs[i + 1] == 0)
+					continue;
+				double cost = traversalCost + intersectCost *
+					(leftRefs * left.aabb.area() + rightRefs[i + 1] * right[i + 1].aabb.area()) / nodeArea;
+				if (cost < bestCost)
 				{
-					flag = true;
-					isect = curIsect;
+					bestCost = cost;
+					bestAxis = axis;
+					spatial = true;
+					splitPos = origin + (i + 1) * binWidth;
+					bestLeft = left.aabb;
+					bestRight = right[i + 1].aabb;
+					leftCount = leftRefs;
+					rightCount = rightRefs[i + 1];
 				}
 			}
 		}
-		return flag;
 	}
-	
-	Isect leftIsect, rightIsect;
-	bool leftSuccess = left->intersect(ray, leftIsect);
-	bool rightSuccess = right->intersect(ray, rightIsect);
-	if (leftSuccess)
+
+	// Nothing to split, or splitting does not pay off
+	double leafCost = intersectCost * n;
+	if (bestAxis == -1 || (n <= maxLeafSize && leafCost <= bestCost))
+	{
+		makeLeaf();
+		return;
+	}
+
+	vector<Reference> left, right;
+	for (const auto& ref : refs)
+	{
+		if (!spatial)
+		{
+			(objectBin(ref, bestAxis) <= bestBin ? left : right).push_back(ref);
+			continue;
+		}
+		if (ref.box.max[bestAxis] <= splitPos)
+		{
+			left.push_back(ref);
+			continue;
+		}
+		if (ref.box.min[bestAxis] >= splitPos)
+		{
+			right.push_back(ref);
+			continue;
+		}
+
+		// straddles the plane, compare splitting it with keeping it whole on either side
+		BoundingBox leftPart, rightPart;
+		clip(ref.prim, ref.box, bestAxis, splitPos, leftPart, rightPart);
+		BoundingBox grownLeft = bestLeft, grownRight = bestRight;
+		grownLeft.merge(ref.box);
+		grownRight.merge(ref.box);
+		double splitCost = bestLeft.area() * leftCount + bestRight.area() * rightCount;
+		double leftCost = grownLeft.area() * leftCount + bestRight.area() * (rightCount - 1);
+		double rightCost = bestLeft.area() * (leftCount - 1) + grownRight.area() * rightCount;
+		bool canSplit = numReferences < maxReferences && !leftPart.isEmpty() && !rightPart.isEmpty();
+		if (canSplit && splitCost < leftCost && splitCost < rightCost)
+		{
+			left.push_back(Reference{ref.prim, leftPart});
+			right.push_back(Reference{ref.prim, rightPart});
+			++numReferences;
+		}
+		else if (rightPart.isEmpty() || (!leftPart.isEmpty() && leftCost <= rightCost))
+			left.push_back(ref);
+		else
+			right.push_back(ref);
+	}
+	if (left.empty() || right.empty())
+	{
+		makeLeaf();
+		return;
+	}
+
+	refs = vector<Reference>();
+	cur->axis = bestAxis;
+	cur->left = new BVHNode;
+	cur->right = new BVHNode;
+	buildSpatial(cur->left, left, depth + 1, clip);
+	left = vector<Reference>();
+	buildSpatial(cur->right, right, depth + 1, clip);
+}
+
+double BVH::computeSAHCost() const
+{
+	if (nodes.empty() || nodes[0].aabb.area() <= 0.0)
+		return 0.0;
+	double cost = 0.0;
+	for (const auto& node : nodes)
 	{
-		if (rightSuccess && rightIsect.t < leftIsect.t)
-			isect = rightIsect;
+		if (node.count > 0)
+			cost += node.aabb.area() * intersectCost * node.count;
 		else
-			isect = leftIsect;
+			cost += node.aabb.area() * traversalCost;
+	}
+	return cost / nodes[0].aabb.area();
+}
+
+// Bounds of the primitives in order[first, last) and of their centroids
+BoundingBox BVH::calMaxBoundingBox(int first, int last, BoundingBox& centroidBounds) const
+{
+	BoundingBox aabb;
+	if (first >= last)
+		return aabb;
+
+	const vector<BoundingBox>& boxes = *primBoxes;
+	auto boundRange = [&](int begin, int end, BoundingBox& box, BoundingBox& cBox)
+	{
+		box = boxes[order[begin]];
+		cBox.min = cBox.max = centroids[order[begin]];
+		for (int i = begin + 1; i < end; ++i)
+		{
+			box.merge(boxes[order[i]]);
+			cBox.min = minimum(cBox.min, centroids[order[i]]);
+			cBox.max = maximum(cBox.max, centroids[order[i]]);
+		}
+	};
+
+	int numChunks = last - first >= parallelThreshold * 4 ? threadCount() : 1;
+	if (numChunks == 1)
+	{
+		boundRange(first, last, aabb, centroidBounds);
+		return aabb;
+	}
+
+	vector<BoundingBox> chunkBoxes(numChunks), chunkCentroids(numChunks);
+	parallelChunks(first, last, numChunks, [&](int begin, int end, int chunk)
+	{
+		boundRange(begin, end, chunkBoxes[chunk], chunkCentroids[chunk]);
+	});
+	aabb = chunkBoxes[0];
+	centroidBounds = chunkCentroids[0];
+	int size = (last - first + numChunks - 1) / numChunks;
+	for (int chunk = 1; chunk < numChunks && first + chunk * size < last; ++chunk)
+	{
+		aabb.merge(chunkBoxes[chunk]);
+		centroidBounds.merge(chunkCentroids[chunk]);
 	}
-	else if (rightSuccess)
-		isect = rightIsect;
+	return aabb;
+}
+
+// Closest hit, nodes entered beyond the closest hit found so far are skipped
+bool BVH::intersect(const Ray& ray, Isect& isect) const
+{
+	bool flag = false;
+	double closest = 1.0e308;
+	traverse(ray, closest, [&](int first, int end)
+	{
+		Isect curIsect;
+		for (int i = first; i < end; ++i)
+		{
+			if (objects[i]->intersectHit(ray, curIsect) && curIsect.t < closest)
+			{
+				flag = true;
+				closest = curIsect.t;
+				isect = curIsect;
+			}
+		}
+		return false;
+	});
 	
-	return leftSuccess || rightSuccess;
+	return flag;
+}
+
+uint64_t BVH::intersect(RayPacket& packet, Isect* isects) const
+{
+	uint64_t hits = 0;
+	traversePacket(packet, [&](int first, int end, uint64_t mask)
+	{
+		for (int i = first; i < end; ++i)
+			hits |= objects[i]->intersectHits(packet, mask, isects);
+	});
+	return hits;
 }
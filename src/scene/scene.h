@@ -10,13 +10,17 @@
 #include <list>
 #include <algorithm>
 #include <vector>
-#include <random>
+#include <functional>
+#include <cfloat>
+#include <cstdint>
+#include <cassert>
 
 class Emitter;
 class Photon;
 class Geometry;
 class Skybox;
 class DirectionalLight;
+class BVHCache;
 using namespace std;
 
 #include "Ray.h"
@@ -25,8 +29,12 @@ using namespace std;
 #include "../vecmath/vecmath.h"
 #include "SolidTexture.h"
 
-extern std::mt19937_64 rng;
-extern uniform_real_distribution<double> unif;
+// The wide BVH tests four child boxes at once with SSE, which every x86-64
+// target and the default Win32 build (/arch:SSE2) provide
+#if !defined(BVH_NO_SIMD) && (defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1))
+#define BVH_SIMD
+#include <xmmintrin.h>
+#endif
 
 class Light;
 class Scene;
@@ -90,38 +98,484 @@ public:
 	// closest to the origin in tMin and the "t" value of the far intersection
 	// in tMax and return true, else return false.
 	bool intersect(const Ray& r, double& tMin, double& tMax) const;
+
+	// grow the box so that it also encloses the target
+	void merge(const BoundingBox& target);
+
+	double area() const;
+
+	// the part both boxes have in common, empty if they don't overlap
+	BoundingBox overlap(const BoundingBox& target) const;
+	bool isEmpty() const;
+	static BoundingBox emptyBox();		// merging anything into it gives that thing
+};
+
+// The origin and inverse direction of a ray rounded to float, for the slab
+// tests of the BVH.  The inverse is clamped to finite values, so that a zero
+// distance times it stays zero.
+class FloatRay
+{
+public:
+	FloatRay() {}
+	explicit FloatRay(const Ray& ray);
+
+	float3 origin;
+	float3 inverse;
+	int sign[3];
+};
+
+// A BoundingBox rounded outwards to float, for the nodes of the BVH
+class FloatBoundingBox
+{
+public:
+	float3 min;
+	float3 max;
+
+	FloatBoundingBox() {}
+	FloatBoundingBox(const BoundingBox& box);
+	operator BoundingBox() const;
+
+	// as BoundingBox::intersect, in float
+	bool intersect(const FloatRay& r, float& tMin, float& tMax) const;
+	double area() const;
+};
+
+inline bool FloatBoundingBox::intersect(const FloatRay& r, float& tMin, float& tMax) const
+{
+	// min and max swap on the axes where the ray goes down
+	float3 enter(r.sign[0] ? max[0] : min[0], r.sign[1] ? max[1] : min[1], r.sign[2] ? max[2] : min[2]);
+	float3 leave(r.sign[0] ? min[0] : max[0], r.sign[1] ? min[1] : max[1], r.sign[2] ? min[2] : max[2]);
+	float3 t0 = prod(enter - r.origin, r.inverse);
+	float3 t1 = prod(leave - r.origin, r.inverse);
+	// widened as in the wide traversal, to make up for the rounding
+	tMin = std::max(std::max(t0[0], t0[1]), t0[2]) * (1.0f - 4.0f * FLT_EPSILON);
+	tMax = std::min(std::min(t1[0], t1[1]), t1[2]) * (1.0f + 4.0f * FLT_EPSILON);
+	return tMin <= tMax && tMax >= 0.0f;
+}
+
+// Bounds of something moving linearly while the shutter is open, at shutter
+// open and close
+class MotionBounds
+{
+public:
+	BoundingBox open;
+	BoundingBox close;
+
+	BoundingBox at(double s) const;		// s goes from 0 at open to 1 at close
+	void merge(const MotionBounds& target);
 };
 
 
-// Node for BVH
+// Node for BVH, only used during construction
 class BVHNode
 {
 public:
 	~BVHNode() { delete left; delete right; }
 
-	bool intersect(const Ray& ray, Isect& isect) const;
-	
-	vector<Geometry*> objects;
 	BoundingBox aabb;
 	BVHNode* left{nullptr}, *right{nullptr};
+	int first{0}, count{0};		// range of a leaf in the primitive order
+	int axis{0};	// split axis
+};
+
+// Node of the flattened BVH.  Nodes are stored in depth-first order, so the
+// first child of an interior node always directly follows it.
+class LinearBVHNode
+{
+public:
+	FloatBoundingBox aabb;
+	int offset;		// leaf: index of the first primitive, interior: index of the second child
+	int count;		// number of primitives, 0 for interior nodes
+	int axis;		// split axis of interior nodes
+	float relArea;	// area relative to the root when the subtree was built
+};
+
+// Node of the 4-wide BVH collapsed from the binary one.  The child boxes are
+// stored per axis in float, rounded outwards, so a ray is tested against all
+// of them at once.  Unused slots have an empty box that no ray can hit.
+class WideBVHNode
+{
+public:
+	static const int width{4};
+
+	void setChild(int slot, const BoundingBox& box, int index, int count);
+	void clearChild(int slot);
+
+	float min[3][width];
+	float max[3][width];
+	int child[width];	// leaf: index of the first primitive, interior: index of the wide node, -1 if unused
+	int count[width];	// number of primitives, 0 for interior nodes
 };
 
 
-// Bounding volume hierarchy
+// Rays traced through the BVHs together, the camera rays of a block of
+// pixels.  Bounds on their origins and inverse directions let the whole
+// packet skip a box none of them can enter.
+class RayPacket
+{
+public:
+	static const int maxSize{64};		// one bit per ray in a mask
+
+	void clear() { size = 0; }
+	void add(const Ray& ray, double tMax = 1.0e308);
+	void computeBounds();		// once the rays are added
+	bool misses(const FloatBoundingBox& box) const;	// true if no ray can enter the box
+	uint64_t allRays() const { return size == maxSize ? ~0ull : (1ull << size) - 1; }
+
+	Ray rays[maxSize];
+	double tMax[maxSize];		// closest hit so far
+	int size{0};
+
+private:
+	vec3f originLow, originHigh;
+	vec3f inverseLow, inverseHigh;
+	bool coherent[3];		// all directions have the same sign on the axis
+};
+
+// Bounding volume hierarchy over primitives given by their bounding boxes.
+// The scene uses it for its bounded objects, and every Trimesh for its faces.
 class BVH
 {
 public:
+	enum class SplitMethod
+	{
+		Median,		// split at the object median of the longest axis
+		SAH,		// binned surface area heuristic
+		SBVH		// SAH with spatial splits, for triangles, SAH for anything else
+	};
+
+	// Bounds of the parts of prim inside box on either side of the plane at pos
+	// on axis, empty if there is no such part
+	typedef std::function<void(int prim, const BoundingBox& box, int axis, double pos,
+		BoundingBox& left, BoundingBox& right)> ClipFunc;
+
 	~BVH() { delete root; }
+	void build(const vector<BoundingBox>& boxes);	// fills nodes and order
 	void build(const list<Geometry*>& objects);		// objects must support bounding box
-	void buildHelper(BVHNode* cur, const vector<Geometry*>& objects);
-	BoundingBox calMaxBoundingBox(const vector<Geometry*>& objects);
+	// With SBVH, primitives straddling a split plane may be clipped into a
+	// reference on each side, so order can list a primitive more than once
+	void build(const vector<BoundingBox>& boxes, const ClipFunc& clip);
+	int flatten(const BVHNode* cur);
+	int collapse(int index);	// collapse the binary subtree at index into wideNodes
+
+	// Recompute the node bounds bottom-up after the primitives moved, boxes are
+	// given per leaf slot.  Subtrees whose area relative to the root grew by more
+	// than rebuildRatio since they were built are rebuilt over the same slots.
+	// Returns true if that reordered the slots, order then holds the old slot of
+	// each slot and the owner has to reorder its primitives the same way.
+	bool refit(const vector<BoundingBox>& boxes);
+	void refit();		// for the objects, which are reordered as needed
+	int rebuild(const vector<LinearBVHNode>& old, int index, int depth, const vector<bool>& degraded, double rootArea);
+
+	// Both builders partition order[first, last) in place, cur is at depth in
+	// the tree.  Subtrees larger than parallelThreshold are built on another
+	// thread while spawnDepth lasts.
+	void buildHelper(BVHNode* cur, int first, int last, int depth, int spawnDepth);
+	void buildSAH(BVHNode* cur, int first, int last, int depth, int spawnDepth);
+	BoundingBox calMaxBoundingBox(int first, int last, BoundingBox& centroidBounds) const;
+
+	// Expected cost of a ray query under the SAH cost model, normalized by the root area
+	double computeSAHCost() const;
 	
+	// Visit the leaves the ray enters no later than tMax, near child first.
+	// leaf(first, end) gets the range of leaf slots and may shrink tMax,
+	// traversal stops as soon as it returns true.
+	template <class LeafVisitor>
+	void traverse(const Ray& ray, double& tMax, LeafVisitor leaf) const;
+#ifdef BVH_SIMD
+	template <class LeafVisitor>
+	void traverseWide(const Ray& ray, double& tMax, LeafVisitor leaf) const;
+#endif
+
+	// Packet version of traverse, for rays with the same time.  leaf(first,
+	// end, mask) gets the rays that enter the leaf box as a mask.
+	template <class LeafVisitor>
+	void traversePacket(const RayPacket& packet, LeafVisitor leaf) const;
+
+	// Closest hit as intersectHit leaves it, the caller computes the surface interaction
 	bool intersect(const Ray& ray, Isect& isect) const;
+	// The same for the rays of a packet, hits closer than their tMax go to
+	// isects and lower it.  Returns the mask of those rays.
+	uint64_t intersect(RayPacket& packet, Isect* isects) const;
+	// Any-hit traversal, calls visitor(Geometry*) for the objects of every leaf
+	// the ray enters before tMax, and stops as soon as it returns true
+	template <class Visitor>
+	bool visit(const Ray& ray, double tMax, Visitor visitor) const;
 	
-	BVHNode* root{nullptr};
+	BVHNode* root{nullptr};		// released once the tree is flattened
+	vector<LinearBVHNode> nodes;
+	vector<WideBVHNode> wideNodes;	// traversed instead of nodes when not empty
+	vector<int> order;			// primitive stored in each leaf slot, in depth-first order
+	vector<Geometry*> objects;	// scene objects of all leaf slots
+	SplitMethod splitMethod{SplitMethod::SAH};
 	int threshold{5};	// if the objects contained in a node is less than threshold, stop subdivision
+	double rebuildRatio{2.0};	// refit rebuilds subtrees that grew by more than this
+	bool wide{true};	// also build the 4-wide BVH, only used with BVH_SIMD
+	// If set, build looks the tree up in the cache first and stores what it
+	// built.  contentKey stands for whatever else the tree depends on.
+	BVHCache* cache{nullptr};
+	uint64_t contentKey{0};
+
+	// Parameters for SAH, costs are relative to a single primitive intersection
+	double traversalCost{0.125};
+	double intersectCost{1.0};
+	int maxLeafSize{8};
+	double maxDuplication{0.3};		// SBVH: up to this many more references than primitives
+	double spatialSplitAlpha{1.0e-5};	// SBVH: try spatial splits if the children overlap more than this, relative to the root
+	static const int numBins{16};
+	static const int stackSize{64};		// max depth of traversal
+	static const int maxDepth{stackSize - 1};	// the builders never split deeper than this
+
+	// Motion blur, rays with a time in the shutter interval are tested against
+	// the node bounds interpolated between open and close, others against aabb
+	double shutterOpen{0.0}, shutterClose{0.0};
+	vector<MotionBounds> motionBounds;	// per node, empty if nothing moves
+	void setMotion(const vector<MotionBounds>& prims);	// prims are per leaf slot
+
+	// Parallel build, nodes smaller than this are built on a single thread
+	int parallelThreshold{4096};
+	int numThreads{0};		// one per core if 0
+
+private:
+	// A primitive, or the part of it a spatial split put on one side
+	struct Reference
+	{
+		int prim;
+		BoundingBox box;
+	};
+	void buildSpatial(BVHNode* cur, vector<Reference>& refs, int depth, const ClipFunc& clip);
+
+	void updateObjectMotion();
+	void beginBuild(const vector<BoundingBox>& boxes);
+	void endBuild();
+	int threadCount() const;
+	int maxSpawnDepth() const;
+
+	// Only valid during build
+	const vector<BoundingBox>* primBoxes{nullptr};
+	vector<vec3f> centroids;
+	int numReferences{0}, maxReferences{0};
+	double spatialRootArea{0.0};
 };
 
+template <class LeafVisitor>
+void BVH::traverse(const Ray& ray, double& tMax, LeafVisitor leaf) const
+{
+	if (nodes.empty())
+		return;
+#ifdef BVH_SIMD
+	if (!wideNodes.empty())
+	{
+		traverseWide(ray, tMax, leaf);
+		return;
+	}
+#endif
+
+	double time = ray.getTime();
+	bool moving = !motionBounds.empty() && time >= shutterOpen && time <= shutterClose;
+	double s = shutterClose > shutterOpen ? (time - shutterOpen) / (shutterClose - shutterOpen) : 0.0;
+
+	const FloatRay floatRay(ray);
+	const int* dirIsNeg = ray.getSign();
+	int stack[stackSize];
+	int top = 0, index = 0;
+	while (true)
+	{
+		const LinearBVHNode& node = nodes[index];
+		float tNear, tFar;
+		bool hit = moving ? FloatBoundingBox(motionBounds[index].at(s)).intersect(floatRay, tNear, tFar)
+			: node.aabb.intersect(floatRay, tNear, tFar);
+		if (hit && tNear <= tMax)
+		{
+			if (node.count > 0)		// leaf node
+			{
+				if (leaf(node.offset, node.offset + node.count))
+					return;
+			}
+			else if (dirIsNeg[node.axis])
+			{
+				assert(top < stackSize);
+				stack[top++] = index + 1;
+				index = node.offset;
+				continue;
+			}
+			else
+			{
+				assert(top < stackSize);
+				stack[top++] = node.offset;
+				index = index + 1;
+				continue;
+			}
+		}
+		if (top == 0)
+			break;
+		index = stack[--top];
+	}
+}
+
+#ifdef BVH_SIMD
+template <class LeafVisitor>
+void BVH::traverseWide(const Ray& ray, double& tMax, LeafVisitor leaf) const
+{
+	const FloatRay floatRay(ray);
+	const int* sign = floatRay.sign;
+	__m128 org[3], inv[3];
+	for (int k = 0; k < 3; ++k)
+	{
+		org[k] = _mm_set1_ps(floatRay.origin[k]);
+		inv[k] = _mm_set1_ps(floatRay.inverse[k]);
+	}
+	// widen the interval to make up for the rounding of the float slab test
+	const __m128 padNear = _mm_set1_ps(1.0f - 4.0f * FLT_EPSILON);
+	const __m128 padFar = _mm_set1_ps(1.0f + 4.0f * FLT_EPSILON);
+
+	// children still to visit, with the distance at which the ray enters them.
+	// Every level leaves at most width - 1 siblings behind.
+	struct Entry { int child, count; float tNear; };
+	Entry stack[stackSize * (WideBVHNode::width - 1)];
+	int top = 0;
+	stack[top++] = Entry{0, 0, 0.0f};
+	while (top > 0)
+	{
+		Entry entry = stack[--top];
+		if (entry.tNear > tMax)
+			continue;
+		if (entry.count > 0)
+		{
+			if (leaf(entry.child, entry.child + entry.count))
+				return;
+			continue;
+		}
+
+		// slab test against all children, min and max swap for negative directions
+		const WideBVHNode& node = wideNodes[entry.child];
+		__m128 tNear = _mm_setzero_ps();
+		__m128 tFar = _mm_set1_ps(float(_min(tMax, double(FLT_MAX))));
+		for (int k = 0; k < 3; ++k)
+		{
+			__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(sign[k] ? node.max[k] : node.min[k]), org[k]), inv[k]);
+			__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(sign[k] ? node.min[k] : node.max[k]), org[k]), inv[k]);
+			// NaN (origin on a slab of a zero direction) keeps the running value
+			tNear = _mm_max_ps(_mm_mul_ps(t0, padNear), tNear);
+			tFar = _mm_min_ps(_mm_mul_ps(t1, padFar), tFar);
+		}
+		int mask = _mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
+		if (mask == 0)
+			continue;
+
+		// push the hit children far to near, so the nearest is visited next
+		float dist[WideBVHNode::width];
+		_mm_storeu_ps(dist, tNear);
+		int hits[WideBVHNode::width], n = 0;
+		for (int i = 0; i < WideBVHNode::width; ++i)
+		{
+			if (!(mask & (1 << i)) || node.child[i] < 0)
+				continue;
+			int j = n++;
+			for (; j > 0 && dist[hits[j - 1]] < dist[i]; --j)
+				hits[j] = hits[j - 1];
+			hits[j] = i;
+		}
+		assert(top + n <= stackSize * (WideBVHNode::width - 1));
+		for (int j = 0; j < n; ++j)
+			stack[top++] = Entry{node.child[hits[j]], node.count[hits[j]], dist[hits[j]]};
+	}
+}
+#endif
+
+// A node is entered with the first ray that hits it, the rays before it
+// missed the node or one of its ancestors and are left out below it.  Nodes
+// the interval bounds of the packet rule out are skipped without scanning
+// the rays, which is most of them outside the silhouettes of a primary packet.
+template <class LeafVisitor>
+void BVH::traversePacket(const RayPacket& packet, LeafVisitor leaf) const
+{
+	if (nodes.empty() || packet.size == 0)
+		return;
+
+	double time = packet.rays[0].getTime();
+	bool moving = !motionBounds.empty() && time >= shutterOpen && time <= shutterClose;
+	double s = shutterClose > shutterOpen ? (time - shutterOpen) / (shutterClose - shutterOpen) : 0.0;
+	FloatRay floatRays[RayPacket::maxSize];
+	for (int i = 0; i < packet.size; ++i)
+		floatRays[i] = FloatRay(packet.rays[i]);
+	auto enters = [&](const FloatBoundingBox& box, int ray)
+	{
+		float tNear, tFar;
+		return box.intersect(floatRays[ray], tNear, tFar) && tNear <= packet.tMax[ray];
+	};
+
+	// one entry per level at most, the builders keep the depth below stackSize
+	struct Entry { int node, first; };
+	Entry stack[stackSize];
+	int top = 0, index = 0, first = 0;
+	FloatBoundingBox moved;
+	while (true)
+	{
+		const LinearBVHNode& node = nodes[index];
+		if (moving)
+			moved = motionBounds[index].at(s);
+		const FloatBoundingBox& box = moving ? moved : node.aabb;
+		if (!enters(box, first))
+		{
+			if (packet.misses(box))
+				first = packet.size;
+			else
+			{
+				do
+					++first;
+				while (first < packet.size && !enters(box, first));
+			}
+		}
+		if (first < packet.size)
+		{
+			if (node.count > 0)		// leaf node
+			{
+				uint64_t mask = 1ull << first;
+				for (int i = first + 1; i < packet.size; ++i)
+				{
+					if (enters(box, i))
+						mask |= 1ull << i;
+				}
+				leaf(node.offset, node.offset + node.count, mask);
+			}
+			else if (packet.rays[first].getSign()[node.axis])
+			{
+				assert(top < stackSize);
+				stack[top++] = Entry{index + 1, first};
+				index = node.offset;
+				continue;
+			}
+			else
+			{
+				assert(top < stackSize);
+				stack[top++] = Entry{node.offset, first};
+				index = index + 1;
+				continue;
+			}
+		}
+		if (top == 0)
+			break;
+		--top;
+		index = stack[top].node;
+		first = stack[top].first;
+	}
+}
+
+template <class Visitor>
+bool BVH::visit(const Ray& ray, double tMax, Visitor visitor) const
+{
+	bool stopped = false;
+	traverse(ray, tMax, [&](int first, int end)
+	{
+		for (int i = first; i < end; ++i)
+			if (visitor(objects[i]))
+				return stopped = true;
+		return false;
+	});
+	return stopped;
+}
+
 
 class TransformNode
 {
@@ -132,6 +586,15 @@ public:
 	mat4f    inverse;
 	mat3f    normi;
 
+	// What xform does, found when the node is made.  Short of General, the
+	// local ray is the global one moved and scaled and the normals keep
+	// their direction, so no matrix is needed.
+	enum class Kind { Identity, Translation, UniformScale, General };
+	Kind kind{Kind::General};
+	vec3f offset;				// translation of xform
+	double invScale{1.0};		// 1 / the scale of a UniformScale
+	mat3f inverseLinear;		// upper 3x3 of inverse
+
     // information about parent & children
     TransformNode *parent;
     list<TransformNode*> children;
@@ -174,6 +637,27 @@ public:
         return (normi * v).normalize();
     }
 
+	// r in local space, with a unit direction, t along it is length times t along r
+	Ray globalToLocalRay(const Ray& r, double& length) const
+	{
+		switch (kind)
+		{
+		case Kind::Identity:
+			length = 1.0;
+			return r;
+		case Kind::Translation:
+			length = 1.0;
+			return r.movedTo(r.getPosition() - offset);
+		case Kind::UniformScale:
+			length = invScale;
+			return r.movedTo((r.getPosition() - offset) * invScale);
+		default:
+			vec3f dir = inverseLinear * r.getDirection();
+			length = dir.length();
+			return Ray(inverse * r.getPosition(), dir, r.getTime());
+		}
+	}
+
 protected:
     // protected so that users can't directly construct one of these...
     // force them to use the createChild() method.  Note that they CAN
@@ -189,7 +673,10 @@ protected:
         
         inverse = this->xform.inverse();
         normi = this->xform.upper33().inverse().transpose();
+        classify();
     }
+
+    void classify();
 };
 
 class TransformRoot : public TransformNode
@@ -207,11 +694,22 @@ class Geometry
 {
 public:
     // intersections performed in the global coordinate space.
-    virtual bool intersect(const Ray&r, Isect&i) const;
+    bool intersect(const Ray&r, Isect&i) const;
+	// Just t and what computeSurfaceInteraction needs for the rest, for
+	// queries that test many objects and keep a single hit
+	virtual bool intersectHit(const Ray& r, Isect& i) const;
+	// intersectHit for the rays of the packet in mask, the hits closer than
+	// their tMax go to isects and lower it.  Returns the mask of those rays.
+	virtual uint64_t intersectHits(RayPacket& packet, uint64_t mask, Isect* isects) const;
+	// Normal, texture coordinates and material of a hit from intersectHit
+	void computeSurfaceInteraction(Isect& i) const;
     
     // intersections performed in the object's local coordinate space
     // do not call directly - this should only be called by intersect()
 	virtual bool intersectLocal( const Ray& r, Isect& i ) const;
+	// For objects whose intersectLocal leaves out what a hit that is not kept
+	// doesn't need, fills it in from i.prim and i.bary, still in local space
+	virtual void computeLocalSurface(Isect& i) const { }
 
 	virtual bool hasTexCoords() const { return enableTexCoords; }
 	virtual void setEnableTexCoords(bool value) { enableTexCoords = value; }
@@ -223,6 +721,13 @@ public:
 
 	virtual bool hasBoundingBoxCapability() const;
 	const BoundingBox& getBoundingBox() const { return bounds; }
+	// Objects that move while the shutter is open return their bounds at open
+	// and close, getBoundingBox() then covers the whole motion
+	virtual bool getMotionBounds(double open, double close, MotionBounds& motion) const { return false; }
+	// For objects with a BVH of their own, built once the scene is read
+	virtual void buildBVH(BVHCache* cache) { }
+	virtual void setBVHSplitMethod(BVH::SplitMethod method) { }
+	virtual void setBVHThreads(int numThreads) { }
 	virtual void ComputeBoundingBox()
     {
         // take the object's local bounding box, transform all 8 points on it,
@@ -362,7 +867,19 @@ public:
 
 	bool intersect( const Ray& r, Isect& i ) const;
 	bool bvhIntersect(const Ray& ray, Isect& isect) const;	// use BVH for acceleration
-	void initScene();
+	uint64_t bvhIntersect(RayPacket& packet, Isect* isects) const;	// mask of the rays that hit
+	// Shadow queries, only hits closer than tMax count
+	bool occluded(const Ray& ray, double tMax) const;		// is there any hit at all
+	vec3f transmittance(const Ray& ray, double tMax) const;	// product of kt of all blockers
+	// Builds the BVHs of the objects and the scene, using the cache if there is one
+	void initScene(BVHCache* cache = nullptr);
+	void buildBVH(BVHCache* cache = nullptr);		// for the shutter interval of the camera
+	// Update the BVH after bounded objects moved and recomputed their bounding boxes
+	void refitBVH();
+
+	void setBVHSplitMethod(BVH::SplitMethod method);	// also for the objects with their own BVH
+	void setBVHThreads(int numThreads);		// the same
+	double getBVHCost() const { return bvh.computeSAHCost(); }
 
 	list<Light*>::const_iterator beginLights() const { return lights.begin(); }
 	list<Light*>::const_iterator endLights() const { return lights.end(); }
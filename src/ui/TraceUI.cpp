@@ -6,7 +6,6 @@
 #include <stdio.h>
 #include <time.h>
 #include <string.h>
-#include <omp.h>
 
 #include <FL/fl_ask.h>
 
@@ -169,6 +168,12 @@ void TraceUI::cb_pathTracingButton(Fl_Widget* o, void* v)
 	ui->raytracer->enablePathTracing = bool( ((Fl_Light_Button*)o)->value() );
 }
 
+void TraceUI::cb_wavefrontButton(Fl_Widget* o, void* v)
+{
+	auto* ui = whoami(o);
+	ui->raytracer->enableWavefront = bool( ((Fl_Light_Button*)o)->value() );
+}
+
 void TraceUI::cb_fasterShadow(Fl_Widget* o, void* v)
 {
 	auto* ui = whoami(o);
@@ -395,38 +400,30 @@ void TraceUI::cb_renderParallel(Fl_Widget* o, void* v)
 
 	// start to render here	
 	done = false;
-	clock_t prev, now;
-	prev = clock();
 
 	pUI->m_traceGlWindow->refresh();
 	Fl::check();
 	Fl::flush();
 
-	for (int y = 0; y < height; y++)
+	// the tiles render on the pool while this thread keeps the window going
+	TileScheduler& scheduler = pUI->raytracer->getScheduler();
+	pUI->raytracer->startLines(0, height);
+	while (!scheduler.isDone())
 	{
-		#pragma omp parallel for num_threads(4)
-		for (int x = 0; x < width; x++)
-		{
-			pUI->raytracer->tracePixel(x, y, 1);
-		}
-		if (done) break;
+		Fl::wait(0.1);
+		if (done)
+			scheduler.cancel();
 
-		// flush when finish a row
-		if (Fl::ready())
+		pUI->m_traceGlWindow->refresh();
+		if (Fl::damage())
 		{
-			// refresh
-			pUI->m_traceGlWindow->refresh();
-			Fl::check();
-
-			if (Fl::damage())
-			{
-				Fl::flush();
-			}
+			Fl::flush();
 		}
 		// update the window label
-		sprintf(buffer, "(%d%%) %s", (int)((double)y / (double)height * 100.0), old_label);
+		sprintf(buffer, "(%d%%) %s", (int)(scheduler.progress() * 100.0), old_label);
 		pUI->m_traceGlWindow->label(buffer);
 	}
+	scheduler.wait();
 	done = true;
 	pUI->m_traceGlWindow->refresh();
 
@@ -520,7 +517,7 @@ TraceUI::TraceUI() {
 	// init.
 	m_nDepth = 0;
 	m_nSize = 150;
-	m_mainWindow = new Fl_Window(100, 40, 330, 540, "Ray <Not Loaded>");
+	m_mainWindow = new Fl_Window(100, 40, 330, 570, "Ray <Not Loaded>");
 		m_mainWindow->user_data((void*)(this));	// record self to be used by static callback functions
 		// install menu bar
 		m_menubar = new Fl_Menu_Bar(0, 0, 330, 25);
@@ -630,7 +627,7 @@ TraceUI::TraceUI() {
 		m_enablePMButton->value(0);
 		m_enablePMButton->callback(cb_enablePM);
 
-		m_numPhotonSlider = createSlider(10, 430, 180, 20, "Photon Num(k)", 10, 100, 1, 50, cb_photonNum);
+		m_numPhotonSlider = createSlider(10, 430, 180, 20, "Photon Num(k)", 10, 2000, 1, 50, cb_photonNum);
 
 		m_numNeighbourSlider = createSlider(10, 455, 180, 20, "Neighbour Num", 10, 100, 1, 20, cb_neighbourNum);
 
@@ -642,6 +639,11 @@ TraceUI::TraceUI() {
 		m_pathTracingButton->value(0);
 		m_pathTracingButton->callback(cb_pathTracingButton);
 	
+		m_wavefrontButton = new Fl_Light_Button(10, 540, 150, 25, "Wavefront PT");
+		m_wavefrontButton->user_data(this);
+		m_wavefrontButton->value(0);
+		m_wavefrontButton->callback(cb_wavefrontButton);
+	
 		m_renderButton = new Fl_Button(220, 510, 100, 25, "Render PT");
 		m_renderButton->user_data((void*)(this));
 		m_renderButton->callback(cb_renderPt);
@@ -37,6 +37,7 @@ public:
 	Fl_Button* m_renderPtButton;
 	Fl_Light_Button* m_ssaaJitterButton;
 	Fl_Light_Button* m_pathTracingButton;
+	Fl_Light_Button* m_wavefrontButton;
 
 	Fl_Light_Button* m_fasterShadow;
 
@@ -114,6 +115,7 @@ private:
 	static void cb_ssaaLevelSlides(Fl_Widget* o, void* v);
 	static void cb_ssaaJitterButton(Fl_Widget* o, void* v);
 	static void cb_pathTracingButton(Fl_Widget* o, void* v);
+	static void cb_wavefrontButton(Fl_Widget* o, void* v);
 	static void cb_fasterShadow(Fl_Widget* o, void* v);
 
 	// Depth of field
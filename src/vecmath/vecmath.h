@@ -7,6 +7,7 @@
 #include <iostream>
 #include <cmath>
 #include <algorithm>
+#include <cstdint>
 
 using namespace std;
 
@@ -36,9 +37,64 @@ inline double maximum( double a, double b )
 	return a > b ? a : b;
 }
 
+// PCG32 (O'Neill, pcg-random.org), a small fast generator with 2^63
+// independent sequences.  The renderer gives every pixel its own sequence so
+// an image doesn't depend on which thread draws it.
+class Random
+{
+public:
+	explicit Random(uint64_t sequence = 0, uint64_t offset = 0) { seed(sequence, offset); }
+
+	void seed(uint64_t sequence, uint64_t offset = 0)
+	{
+		state = 0;
+		inc = sequence << 1 | 1;
+		next();
+		state += 0x853c49e6748fea9bULL + offset * 0x9e3779b97f4a7c15ULL;
+		next();
+	}
+	uint32_t next()
+	{
+		uint64_t old = state;
+		state = old * 0x5851f42d4c957f2dULL + inc;
+		uint32_t shifted = uint32_t(((old >> 18) ^ old) >> 27);
+		uint32_t rot = uint32_t(old >> 59);
+		return (shifted >> rot) | (shifted << ((32 - rot) & 31));
+	}
+	double nextReal()		// in [0, 1)
+	{
+		return next() * (1.0 / 4294967296.0);
+	}
+
+private:
+	uint64_t state, inc;
+};
+
+// The generator getRandomReal draws from on this thread, its own one unless
+// a RandomScope is open
+inline Random*& currentRandom()
+{
+	static thread_local Random own;
+	static thread_local Random* current = &own;
+	return current;
+}
+
+// Makes rng the generator of this thread while in scope
+class RandomScope
+{
+public:
+	explicit RandomScope(Random& rng) : previous(currentRandom()) { currentRandom() = &rng; }
+	~RandomScope() { currentRandom() = previous; }
+	RandomScope(const RandomScope&) = delete;
+	RandomScope& operator=(const RandomScope&) = delete;
+
+private:
+	Random* previous;
+};
+
 inline double getRandomReal()
 {
-	return (double) rand() / RAND_MAX;
+	return currentRandom()->nextReal();
 }
 
 inline double getRandomReal(double min, double max)
@@ -200,6 +256,69 @@ public:
 	double n[4];
 };
 
+// Single precision vector for data kept in bulk, such as photons and BVH
+// node bounds, at half the size of a vec3f.  It converts to vec3f and back,
+// and has the arithmetic of the slab tests, which run in float.
+class float3
+{
+public:
+	float3() { n[0] = 0.0f; n[1] = 0.0f; n[2] = 0.0f; }
+	float3( const float x, const float y, const float z )
+		{ n[0] = x; n[1] = y; n[2] = z; }
+	float3( const vec3f& v )
+		{ n[0] = float( v[0] ); n[1] = float( v[1] ); n[2] = float( v[2] ); }
+
+	operator vec3f() const
+		{ return vec3f( n[0], n[1], n[2] ); }
+
+	float3& operator +=( const float3& v )
+		{ n[0] += v.n[0]; n[1] += v.n[1]; n[2] += v.n[2]; return *this; }
+	float3& operator -=( const float3& v )
+		{ n[0] -= v.n[0]; n[1] -= v.n[1]; n[2] -= v.n[2]; return *this; }
+	float3& operator *=( const float d )
+		{ n[0] *= d; n[1] *= d; n[2] *= d; return *this; }
+
+	float& operator []( int i )
+		{ return n[i]; }
+	float operator []( int i ) const 
+		{ return n[i]; }
+
+public:
+	float n[3];
+};
+
+inline float3 operator +( const float3& a, const float3& b )
+{
+	return float3( a.n[0] + b.n[0], a.n[1] + b.n[1], a.n[2] + b.n[2] );
+}
+
+inline float3 operator -( const float3& a, const float3& b )
+{
+	return float3( a.n[0] - b.n[0], a.n[1] - b.n[1], a.n[2] - b.n[2] );
+}
+
+inline float3 operator *( const float3& a, const float d )
+{
+	return float3( a.n[0] * d, a.n[1] * d, a.n[2] * d );
+}
+
+inline float3 prod( const float3& a, const float3& b )
+{
+	return float3( a.n[0] * b.n[0], a.n[1] * b.n[1], a.n[2] * b.n[2] );
+}
+
+inline float3 minimum( const float3& a, const float3& b )
+{
+	return float3( a.n[0] < b.n[0] ? a.n[0] : b.n[0], a.n[1] < b.n[1] ? a.n[1] : b.n[1],
+		a.n[2] < b.n[2] ? a.n[2] : b.n[2] );
+}
+
+inline float3 maximum( const float3& a, const float3& b )
+{
+	return float3( a.n[0] > b.n[0] ? a.n[0] : b.n[0], a.n[1] > b.n[1] ? a.n[1] : b.n[1],
+		a.n[2] > b.n[2] ? a.n[2] : b.n[2] );
+}
+
 class mat3f
 {
 public: